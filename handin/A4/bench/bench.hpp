@@ -0,0 +1,102 @@
+#ifndef CS488_BENCH_HPP
+#define CS488_BENCH_HPP
+
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include <stdint.h>
+#include "algebra.hpp"
+
+// Runs f() over and over until at least min_seconds have passed and returns the average time per call
+// in seconds. f() is called once before timing starts so caches are warm and lazy setup is out of the way
+template<typename F>
+double bench_time(F f, double min_seconds = 0.5)
+{
+  typedef std::chrono::steady_clock Clock;
+
+  f();
+
+  long runs = 0;
+  Clock::time_point start = Clock::now();
+  double elapsed = 0.0;
+  do
+  {
+    f();
+    runs++;
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  } while(elapsed < min_seconds);
+
+  return elapsed / runs;
+}
+
+// Small deterministic random number generator (xorshift64*) so every build of a benchmark sees the same input
+class BenchRandom {
+public:
+  BenchRandom(uint64_t seed = 88172645463325252ull)
+    : m_state(seed)
+  {
+  }
+
+  // Uniform in [0, 1)
+  double next()
+  {
+    m_state ^= m_state >> 12;
+    m_state ^= m_state << 25;
+    m_state ^= m_state >> 27;
+    return (m_state * 2685821657736338717ull >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  // Uniform in [lo, hi)
+  double next(double lo, double hi)
+  {
+    return lo + (hi - lo) * next();
+  }
+
+private:
+  uint64_t m_state;
+};
+
+// A unit sphere split into rings x segments quads with its radius perturbed a little at every vertex, so
+// meshes built from it have a nontrivial BVH. Poles are fans of triangles
+inline void bench_sphere(int rings, int segments, std::vector<Point3D>& verts, std::vector< std::vector<int> >& faces)
+{
+  BenchRandom random(12345);
+
+  verts.push_back(Point3D(0.0, 1.0, 0.0));
+  for(int r = 1; r < rings; r++)
+  {
+    double phi = M_PI * r / rings;
+    for(int s = 0; s < segments; s++)
+    {
+      double theta = 2.0 * M_PI * s / segments;
+      double radius = 1.0 + random.next(-0.01, 0.01);
+      verts.push_back(Point3D(radius * sin(phi) * cos(theta), radius * cos(phi), radius * sin(phi) * sin(theta)));
+    }
+  }
+  verts.push_back(Point3D(0.0, -1.0, 0.0));
+
+  int bottom = verts.size() - 1;
+  for(int s = 0; s < segments; s++)
+  {
+    int s1 = (s + 1) % segments;
+
+    std::vector<int> top(3);
+    top[0] = 0; top[1] = 1 + s1; top[2] = 1 + s;
+    faces.push_back(top);
+
+    for(int r = 1; r < rings - 1; r++)
+    {
+      int a = 1 + (r - 1) * segments, b = 1 + r * segments;
+      std::vector<int> quad(4);
+      quad[0] = a + s; quad[1] = a + s1; quad[2] = b + s1; quad[3] = b + s;
+      faces.push_back(quad);
+    }
+
+    int last = 1 + (rings - 2) * segments;
+    std::vector<int> tail(3);
+    tail[0] = bottom; tail[1] = last + s; tail[2] = last + s1;
+    faces.push_back(tail);
+  }
+}
+
+#endif
@@ -0,0 +1,133 @@
+// Compares tracing through the binary BVH layout and the 4-wide one it is collapsed into, on the cow from
+// macho-cows.lua and on a big mesh: bvh_layout [big.obj], e.g. a scanned model like the Stanford dragon. Without
+// one a finely tessellated sphere stands in. Both layouts should hit exactly the same triangles at the same t
+#include <cstdio>
+#include <string>
+#include <iostream>
+#include "bench.hpp"
+#include "mesh.hpp"
+#include "objfile.hpp"
+#include "cachefile.hpp"
+#include "threadpool.hpp"
+
+static const int IMAGE_SIZE = 512;
+
+// Rays through the pixel centres of a square image looking down -z at the mesh's bounds, from far enough away that
+// the whole mesh is in view
+static std::vector<Ray> bench_rays(const BoundingBox& bounds)
+{
+  Point3D centre = bounds.centroid();
+  Vector3D extent = bounds.max() - bounds.min();
+  double size = 0.6 * std::max(extent[0], extent[1]);
+  Point3D eye(centre[0], centre[1], bounds.max()[2] + 2.0 * size);
+
+  std::vector<Ray> rays;
+  for(int y = 0; y < IMAGE_SIZE; y++)
+  {
+    for(int x = 0; x < IMAGE_SIZE; x++)
+    {
+      Point3D p(centre[0] + size * (2.0 * (x + 0.5) / IMAGE_SIZE - 1.0),
+                centre[1] + size * (2.0 * (y + 0.5) / IMAGE_SIZE - 1.0), bounds.max()[2]);
+      rays.push_back(Ray(eye, p - eye));
+    }
+  }
+  return rays;
+}
+
+static void run(const char* name, const Mesh& mesh)
+{
+  const BVH& bvh = mesh.bvh();
+  size_t bytes = bvh.wide() ? bvh.wide_nodes().size() * sizeof(BVH::WideNode) : bvh.nodes().size() * sizeof(BVH::Node);
+  std::printf("%s, %zu triangles, %s BVH, %.1f MB of nodes\n", name, mesh.triangle_count(),
+              bvh.wide() ? "4-wide" : "binary", bytes / (1024.0 * 1024.0));
+  std::cout << "  " << bvh.stats() << std::endl;
+
+  std::vector<Ray> rays = bench_rays(mesh.get_bounds());
+
+  int hits = 0;
+  double sum_t = 0.0;
+  double closest = bench_time([&] {
+    hits = 0;
+    sum_t = 0.0;
+    for(const auto& ray : rays)
+    {
+      Intersection j;
+      if(!mesh.intersect(ray, j)) continue;
+      hits++;
+      sum_t += j.t;
+    }
+  });
+  std::printf("  closest hit: %.2f Mrays/s, %d hits, mean t %.9f\n", rays.size() / closest * 1e-6, hits,
+              hits ? sum_t / hits : 0.0);
+
+  int occluded = 0;
+  double any = bench_time([&] {
+    occluded = 0;
+    for(const auto& ray : rays)
+    {
+      if(mesh.occluded(ray)) occluded++;
+    }
+  });
+  std::printf("  any hit: %.2f Mrays/s, %d hits\n", rays.size() / any * 1e-6, occluded);
+
+  int packet_hits = 0;
+  double packet = bench_time([&] {
+    packet_hits = 0;
+    for(int y = 0; y < IMAGE_SIZE; y += RAY_PACKET_HEIGHT)
+    {
+      for(int x = 0; x < IMAGE_SIZE; x += RAY_PACKET_WIDTH)
+      {
+        RayPacket p;
+        for(int k = 0; k < RayPacket::SIZE; k++)
+        {
+          p.set(k, rays[(y + k / RAY_PACKET_WIDTH) * IMAGE_SIZE + x + k % RAY_PACKET_WIDTH], std::numeric_limits<double>::infinity());
+        }
+        p.update();
+        unsigned int mask = mesh.intersect_packet(p);
+        for(; mask != 0; mask &= mask - 1) packet_hits++;
+      }
+    }
+  });
+  std::printf("  packets: %.2f Mrays/s, %d hits\n", rays.size() / packet * 1e-6, packet_hits);
+}
+
+// Builds the mesh once in each layout and traces the same rays through both. An empty filename means the sphere
+static bool compare(const char* name, const std::string& filename)
+{
+  for(int wide = 0; wide < 2; wide++)
+  {
+    set_wide_bvh(wide != 0);
+
+    if(filename.empty())
+    {
+      std::vector<Point3D> verts;
+      std::vector< std::vector<int> > faces;
+      bench_sphere(700, 1400, verts, faces);
+      Mesh mesh(verts, faces);
+      run(name, mesh);
+      continue;
+    }
+
+    std::vector<GeomPoint3D> verts;
+    std::vector<unsigned int> indices;
+    std::string error;
+    if(!read_obj(filename, verts, indices, error, &render_pool()))
+    {
+      std::fprintf(stderr, "%s\n", error.c_str());
+      return false;
+    }
+    Mesh mesh(std::move(verts), std::move(indices));
+    run(name, mesh);
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  // Every tree has to be built in the layout asked for rather than come out of the cache
+  set_cache_dir("");
+
+  if(!compare("cow", "../data/cow.obj")) return 1;
+  if(!compare((argc > 1) ? argv[1] : "sphere", (argc > 1) ? argv[1] : "")) return 1;
+  return 0;
+}
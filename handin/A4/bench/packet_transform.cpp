@@ -0,0 +1,87 @@
+// Times taking a packet of rays into an instance's model coordinates with RayPacket::transform, which does
+// DVec::WIDTH rays per instruction, against transforming the same rays one at a time. Build with different
+// OPTFLAGS (e.g. -O3 -mno-avx, -O3 -mno-sse2 on 32 bit x86) to compare the SSE2 and scalar builds of DVec
+#include <cstdio>
+#include <cmath>
+#include <limits>
+#include "bench.hpp"
+#include "packet.hpp"
+
+static const int COUNT = 1024;
+
+static Affine3x4 random_transform(BenchRandom& random)
+{
+  Affine3x4 m;
+  for(int r = 0; r < 3; r++)
+  {
+    for(int c = 0; c < 4; c++) m[r][c] = random.next(-1.0, 1.0);
+  }
+  return m;
+}
+
+static Vector3D random_vector(BenchRandom& random)
+{
+  return Vector3D(random.next(-1.0, 1.0), random.next(-1.0, 1.0), random.next(-1.0, 1.0));
+}
+
+int main()
+{
+  std::printf("DVec width: %d, packet size: %d\n", DVec::WIDTH, RayPacket::SIZE);
+
+  BenchRandom random;
+  std::vector<Affine3x4> transforms;
+  for(int i = 0; i < COUNT; i++) transforms.push_back(random_transform(random));
+
+  std::vector<Ray> rays;
+  RayPacket packet;
+  for(int k = 0; k < RayPacket::SIZE; k++)
+  {
+    rays.push_back(Ray(Point3D(0.0, 0.0, 0.0) + random_vector(random), random_vector(random)));
+    packet.set(k, rays.back(), std::numeric_limits<double>::infinity());
+  }
+  packet.update();
+
+  // Every lane of every result is summed so the compiler can't skip any of the work
+  std::vector<Ray> local(rays);
+  double sum_rays = 0.0, sum_packets = 0.0;
+  double single = bench_time([&] {
+    sum_rays = 0.0;
+    for(int i = 0; i < COUNT; i++)
+    {
+      for(int k = 0; k < RayPacket::SIZE; k++) local[k] = rays[k].transform(transforms[i]);
+      for(int k = 0; k < RayPacket::SIZE; k++) sum_rays += local[k].origin()[0] + local[k].inv_direction()[2];
+    }
+  });
+  double packets = bench_time([&] {
+    sum_packets = 0.0;
+    for(int i = 0; i < COUNT; i++)
+    {
+      RayPacket p = packet.transform(transforms[i]);
+      for(int k = 0; k < RayPacket::SIZE; k++) sum_packets += p.o[0][k] + p.inv[2][k];
+    }
+  });
+
+  double per_ray = 1e9 / (COUNT * RayPacket::SIZE);
+  std::printf("ray transform    one at a time %6.2f ns  packet %6.2f ns  (%.2fx)  sums %.6g %.6g\n",
+              single * per_ray, packets * per_ray, single / packets, sum_rays, sum_packets);
+
+  // Both do the same arithmetic in the same order so they normally agree exactly. With FMA the compiler is
+  // free to fuse different multiply/adds in each, so only the last bit or so may differ
+  double diff = 0.0;
+  for(int i = 0; i < COUNT; i++)
+  {
+    RayPacket p = packet.transform(transforms[i]);
+    for(int k = 0; k < RayPacket::SIZE; k++)
+    {
+      Ray r = rays[k].transform(transforms[i]);
+      for(int a = 0; a < 3; a++)
+      {
+        diff = std::max(diff, std::fabs(r.origin()[a] - p.o[a][k]));
+        diff = std::max(diff, std::fabs(r.direction()[a] - p.d[a][k]));
+      }
+    }
+  }
+  std::printf("max difference: %g\n", diff);
+
+  return diff > 1e-12;
+}
@@ -0,0 +1,76 @@
+// Compares storing mesh geometry in single and double precision. Build it twice, once with
+// -DCS488_FLOAT_GEOMETRY (make precision_float and precision_double) and compare the output:
+// the float build should use half the memory per triangle, trace at least as fast and hit the
+// same things at very nearly the same t
+#include <cstdio>
+#include <cstdlib>
+#include "bench.hpp"
+#include "mesh.hpp"
+
+static const int IMAGE_SIZE = 512;
+
+int main(int argc, char** argv)
+{
+  int rings = (argc > 1) ? std::atoi(argv[1]) : 500;
+
+  std::vector<Point3D> verts;
+  std::vector< std::vector<int> > faces;
+  bench_sphere(rings, 2*rings, verts, faces);
+  Mesh mesh(verts, faces);
+
+  size_t triangles = 2 * rings * (2 * rings) - 2 * (2 * rings);
+  std::printf("geometry precision: %s\n", (sizeof(GeomReal) == sizeof(float)) ? "float" : "double");
+  std::printf("triangles: %zu at %zu bytes each (%.1f MB)\n", triangles, sizeof(Mesh::Triangle),
+              triangles * sizeof(Mesh::Triangle) / (1024.0 * 1024.0));
+
+  // A pinhole camera looking at the sphere from z = 3, covering it with a little room to spare. Rays go through
+  // pixel centres, a ray through x = 0 would run exactly along the sphere's seam
+  std::vector<Ray> rays;
+  Point3D eye(0.0, 0.0, 3.0);
+  for(int y = 0; y < IMAGE_SIZE; y++)
+  {
+    for(int x = 0; x < IMAGE_SIZE; x++)
+    {
+      Point3D p(2.4 * (x + 0.5) / IMAGE_SIZE - 1.2, 2.4 * (y + 0.5) / IMAGE_SIZE - 1.2, 0.0);
+      rays.push_back(Ray(eye, p - eye));
+    }
+  }
+
+  int hits = 0;
+  double sum_t = 0.0;
+  double scalar = bench_time([&] {
+    hits = 0;
+    sum_t = 0.0;
+    for(const auto& ray : rays)
+    {
+      Intersection j;
+      if(!mesh.intersect(ray, j)) continue;
+      hits++;
+      sum_t += j.t;
+    }
+  });
+  std::printf("scalar: %.2f Mrays/s, %d hits, mean t %.9f\n", rays.size() / scalar * 1e-6, hits, sum_t / hits);
+
+  // The same rays in packets of RAY_PACKET_WIDTH x RAY_PACKET_HEIGHT pixels
+  int packet_hits = 0;
+  double packet = bench_time([&] {
+    packet_hits = 0;
+    for(int y = 0; y < IMAGE_SIZE; y += RAY_PACKET_HEIGHT)
+    {
+      for(int x = 0; x < IMAGE_SIZE; x += RAY_PACKET_WIDTH)
+      {
+        RayPacket p;
+        for(int k = 0; k < RayPacket::SIZE; k++)
+        {
+          p.set(k, rays[(y + k / RAY_PACKET_WIDTH) * IMAGE_SIZE + x + k % RAY_PACKET_WIDTH], std::numeric_limits<double>::infinity());
+        }
+        p.update();
+        unsigned int mask = mesh.intersect_packet(p);
+        for(; mask != 0; mask &= mask - 1) packet_hits++;
+      }
+    }
+  });
+  std::printf("packet: %.2f Mrays/s, %d hits\n", rays.size() / packet * 1e-6, packet_hits);
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+// Checks that the packet slab tests, RayPacket::hits and the box primitives' intersect_packet, agree with the single
+// ray ones for rays that start on a face of a box and run along it, where a zero direction component makes
+// 0 * infinity = NaN. Exits with 1 if any ray disagrees
+#include <cstdio>
+#include <limits>
+#include "bench.hpp"
+#include "primitive.hpp"
+
+int main()
+{
+  // The box is the unit cube. Every ray starts on one of the planes of its faces, with the direction along that
+  // axis +0 or -0, and goes in every direction along the plane from inside, outside and on the edges of the face
+  const double coords[] = {-0.5, 0.0, 0.25, 1.0, 1.5};
+  const double dirs[] = {-1.0, -0.0, 0.0, 0.3, 1.0};
+  BoundingBox box(Point3D(0.0, 0.0, 0.0), Point3D(1.0, 1.0, 1.0));
+  Cube cube;
+  NonhierBox nonhier_box(Point3D(0.0, 0.0, 0.0), 1.0);
+  const Primitive* primitives[] = {&cube, &nonhier_box};
+  const char* names[] = {"Cube", "NonhierBox"};
+
+  int rays = 0, hits = 0, wrong = 0;
+  for(int a = 0; a < 3; a++)
+  {
+    int b = (a + 1) % 3, c = (a + 2) % 3;
+    for(double plane : {0.0, 1.0})
+    {
+      for(double along : {0.0, -0.0})
+      {
+        for(double ob : coords)
+        {
+          for(double oc : coords)
+          {
+            for(double db : dirs)
+            {
+              for(double dc : dirs)
+              {
+                if(db == 0.0 && dc == 0.0) continue;
+
+                Point3D origin;
+                Vector3D direction;
+                origin[a] = plane;
+                origin[b] = ob;
+                origin[c] = oc;
+                direction[a] = along;
+                direction[b] = db;
+                direction[c] = dc;
+                Ray ray(origin, direction);
+
+                double tnear;
+                bool expected = box.intersect(ray, std::numeric_limits<double>::infinity(), tnear);
+
+                RayPacket packet;
+                for(int k = 0; k < RayPacket::SIZE; k++) packet.set(k, ray, std::numeric_limits<double>::infinity());
+                packet.update();
+                bool got = packet.hits(box);
+
+                rays++;
+                if(expected) hits++;
+                if(got != expected)
+                {
+                  wrong++;
+                  if(wrong <= 10)
+                  {
+                    std::printf("RayPacket::hits %d, BoundingBox::intersect %d for origin %g %g %g direction %g %g %g\n",
+                                got, expected, origin[0], origin[1], origin[2], direction[0], direction[1], direction[2]);
+                  }
+                }
+
+                // The primitives have to agree on the t of the hit too
+                for(int p = 0; p < 2; p++)
+                {
+                  Intersection j;
+                  bool hit = primitives[p]->intersect(ray, j);
+                  RayPacket local(packet);
+                  bool packet_hit = (primitives[p]->intersect_packet(local) & 1) != 0;
+                  if(hit == packet_hit && (!hit || local.t[0] == j.t)) continue;
+
+                  wrong++;
+                  if(wrong <= 10)
+                  {
+                    std::printf("%s::intersect_packet %d at %g, intersect %d at %g for origin %g %g %g direction %g %g %g\n",
+                                names[p], packet_hit, local.t[0], hit, j.t,
+                                origin[0], origin[1], origin[2], direction[0], direction[1], direction[2]);
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  std::printf("%d rays along box faces, %d hit, %d where the packet and single ray tests disagree\n", rays, hits, wrong);
+  return wrong > 0;
+}
@@ -1,32 +1,53 @@
 #include "a4.hpp"
 #include "image.hpp"
+#include "threadpool.hpp"
+#include "progress.hpp"
 
-#include <pthread.h>
 #include <cmath>
 #include <algorithm>
-
-struct RenderThreadData {
-  Image& img;
-  int ystart, yskip, width, height;
-  SceneNode* root;
-  Matrix4x4 unproject;
+#include <limits>
+#include <vector>
+#include <atomic>
+
+// Tiles are square blocks of pixels rendered as one task by the thread pool. Small enough that there are
+// plenty to steal near the end of a render, big enough that scheduling them costs nothing
+static const int TILE_SIZE = 16;
+
+// How often the main thread wakes up to print the progress of the render
+static const std::chrono::milliseconds PROGRESS_INTERVAL(500);
+
+// The coarse passes of a progressive render trace one pixel in COARSE_STRIDE_START, then halve the stride down to
+// one pixel in COARSE_STRIDE before the full render. Both divide TILE_SIZE. That's 1/16 of the pixels traced twice
+static const int COARSE_STRIDE_START = 16;
+static const int COARSE_STRIDE = 4;
+
+// Rays cast by the calling thread that haven't been added to the render's Progress yet
+static thread_local long long t_rays = 0;
+
+struct RenderData {
+  Image& img; // Holds the rows from img_y0 on, the whole image unless the render is streamed a band at a time
+  int img_y0;
+  int width, height;
+  const SceneBVH* scene;
+  Affine3x4 unproject;
   Point3D eye;
   Colour ambient;
-  std::list<Light*> lights;
-  int* progress;
-  bool* done;
+  const std::list<Light*>& lights;
+  const RenderOptions& options;
+  Progress& progress;
+  std::atomic<long long>& samples; // Primary rays traced, for the average samples per pixel
 };
 
-Matrix4x4 a4_get_unproject_matrix(int width, int height, double fov, double d, Point3D eye, Vector3D view, Vector3D up)
+Affine3x4 a4_get_unproject_matrix(int width, int height, double fov, double d, Point3D eye, Vector3D view, Vector3D up)
 {
   double fov_r = fov * M_PI / 180.0;
   double h = 2.0*d*tan(fov_r / 2.0); // height of projection plane based field of view and distance to the plane
   
   // First translate the pixel so that it is centered at the origin in the projection plane (origin is in the middle of the screen)
-  Matrix4x4 viewport_translate = Matrix4x4().translate(-(double)width / 2.0, -(double)height / 2.0, d);
+  Affine3x4 viewport_translate = Affine3x4().translate(-(double)width / 2.0, -(double)height / 2.0, d);
 
   // Then scale it to the projection plane such that aspect ratio is maintained and we have a right handed coordinate system
-  Matrix4x4 viewport_scale = Matrix4x4().scale(-h / (double)height, -h / (double)height, 1.0);
+  Affine3x4 viewport_scale = Affine3x4().scale(-h / (double)height, -h / (double)height, 1.0);
 
   // Calculate the basis for the view coordinate system
   view.normalize();
@@ -37,20 +58,19 @@ Matrix4x4 a4_get_unproject_matrix(int width, int height, double fov, double d, P
   v.normalize();
 
   // Create the view rotation and translation matrix
-  Matrix4x4 view_rotate = Matrix4x4(Vector4D(u, 0.0), Vector4D(v, 0.0), Vector4D(view, 0.0), Vector4D(0.0, 0.0, 0.0, 1.0)).transpose();
-  Matrix4x4 view_translate = Matrix4x4().translate(Vector3D(eye));
+  Affine3x4 view_rotate = Affine3x4(u, v, view, Vector3D(0.0, 0.0, 0.0));
+  Affine3x4 view_translate = Affine3x4().translate(Vector3D(eye));
 
   // Now multiply these together to form the pixel to 3D point transformation matrix
-  Matrix4x4 unproject = view_translate * view_rotate * viewport_scale * viewport_translate;
+  Affine3x4 unproject = view_translate * view_rotate * viewport_scale * viewport_translate;
 
   return unproject;
 }
 
-Colour a4_lighting(const Ray& ray, const Intersection& i, const Light* light)
+Colour a4_lighting(const Ray& ray, const SurfacePoint& s, const MaterialData& material, const Light* light)
 {
-  Point3D surface_point = i.q;
-  Vector3D normal = i.n;
-  const PhongMaterial *material = dynamic_cast<const PhongMaterial*>(i.m);
+  Point3D surface_point = s.q;
+  Vector3D normal = s.n;
     
   // Set up the parameters for the lights
   // Calculate the vector from the surface point to the light source
@@ -63,7 +83,7 @@ Colour a4_lighting(const Ray& ray, const Intersection& i, const Light* light)
   double diffuse_brightness = std::max(0.0, normal.dot(surface_to_light)); 
 
   // Calculate the diffuse colour component
-  Colour diffuse = diffuse_brightness * material->diffuse() * light->colour;
+  Colour diffuse = diffuse_brightness * material.kd * light->colour;
 
   // Calculate the angle of reflectance
   // The incidence vector is the vector surface_to_light but in the opposite direction
@@ -75,10 +95,10 @@ Colour a4_lighting(const Ray& ray, const Intersection& i, const Light* light)
 
   // Calculate the specular brightness
   // Can't have specular highlights if no diffuse lighting at the point!
-  double specular_brightness = (diffuse_brightness > 0) ? pow(std::max(0.0, surface_to_eye.dot(reflected)), material->shininess()) : 0.0;
+  double specular_brightness = (diffuse_brightness > 0) ? pow(std::max(0.0, surface_to_eye.dot(reflected)), material.shininess) : 0.0;
 
   // Calculate the specular colour component
-  Colour specular = specular_brightness * material->specular() * light->colour;
+  Colour specular = specular_brightness * material.ks * light->colour;
 
   // Calculate attenuation factor
   double attenuation = 1.0 / (light->falloff[0] + light->falloff[1]*distance_to_light + light->falloff[2]*(distance_to_light*distance_to_light));
@@ -86,90 +106,257 @@ Colour a4_lighting(const Ray& ray, const Intersection& i, const Light* light)
   return attenuation * (diffuse + specular);
 }
 
-Colour a4_trace_ray(const Ray& ray, const SceneNode *root, const std::list<Light*>& lights, const Colour& ambient, const Colour& bg, int recurse_level)
+Colour a4_shade(const Ray& ray, const SurfacePoint& s, const SceneBVH *scene, const std::list<Light*>& lights, const Colour& ambient, int recurse_level);
+
+Colour a4_trace_ray(const Ray& ray, const SceneBVH *scene, const std::list<Light*>& lights, const Colour& ambient, const Colour& bg, int recurse_level)
 {
   // Test intersection of ray with scene for each light source
-  Colour colour = bg;
   Intersection i;
 
-  bool intersected = root->intersect(ray, i);
+  t_rays++;
+
+  bool intersected = scene->intersect(ray, i);
 
-  if(intersected)
+  return intersected ? a4_shade(ray, scene->get_surface(ray, i), scene, lights, ambient, recurse_level) : bg;
+}
+
+Colour a4_shade_phong(const Ray& ray, const SurfacePoint& s, const MaterialData& material, const SceneBVH *scene, const std::list<Light*>& lights, const Colour& ambient, int recurse_level)
+{
+  // Calculate hit point. Move the hit position a little away from the object so the ray doesn't intersect from the originating object
+  Point3D hit = s.q + (1e-9)*s.n;
+
+  // Add the ambient colour to the object
+  Colour colour = ambient * material.kd;
+
+  for(auto light : lights)
   {
-    // Calculate hit point. Move the hit position a little away from the object so the ray doesn't intersect from the originating object
-    Point3D hit = i.q + (1e-9)*i.n;
+    // Cast shadow rays to the light source. If the ray intersects an object before reaching the light
+    // source then don't count that light sources contribution since it is being blocked
+    // Any hit at all between the surface and the light will do, so this doesn't need the closest one
+    // The ray stops at the light so anything behind it doesn't cast a shadow
+    Ray shadow(hit, light->position-hit, 0.0, (light->position-hit).length());
+    t_rays++;
+    
+    if(scene->occluded(shadow)) continue;
 
-    // Add the ambient colour to the object
-    const PhongMaterial* material = dynamic_cast<const PhongMaterial*>(i.m);
-    colour = ambient * material->diffuse();
+    // Perform phong shading at intersection point. The ambient factor is essentially 1 / number of lights.
+    // This is so that the ambient light is not added to the final colour multiple times (one time for each light source)
+    colour = colour + a4_lighting(ray, s, material, light);
+  }
 
-    for(auto light : lights)
-    {
-      // Cast shadow rays to the light source. If the ray intersects an object before reaching the light
-      // source then don't count that light sources contribution since it is being blocked
-      Ray shadow(hit, light->position-hit);
-      Intersection u;
-      
-      // Make sure to check if intersection point is before light source
-      if(root->intersect(shadow, u) && (u.q-shadow.origin()).length() < (light->position-shadow.origin()).length()) continue;
-
-      // Perform phong shading at intersection point. The ambient factor is essentially 1 / number of lights.
-      // This is so that the ambient light is not added to the final colour multiple times (one time for each light source)
-      colour = colour + a4_lighting(ray, i, light);
+  // Cast reflection rays and add the colour returned to render reflections on object
+  Colour reflected_colour(0.0, 0.0, 0.0);
+  if(recurse_level > 0) 
+  {
+    Ray reflected_ray(hit, ray.direction() - 2*ray.direction().dot(s.n)*s.n);
+    reflected_colour = a4_trace_ray(reflected_ray, scene, lights, ambient, reflected_colour, --recurse_level);
+  }
+
+  // Add the reflection. A coefficient is multiplied with the colour to damp the saturation due to multiple light sources
+  colour = colour + (1.0 / lights.size()) * reflected_colour * material.ks;
+
+  return colour;
+}
+
+Colour a4_shade(const Ray& ray, const SurfacePoint& s, const SceneBVH *scene, const std::list<Light*>& lights, const Colour& ambient, int recurse_level)
+{
+  // Look the material up in the scene's table and pick the shading function for its type
+  const MaterialData& material = scene->get_material(s.material);
+  switch(material.type)
+  {
+  case Material::PHONG:
+  default:
+    return a4_shade_phong(ray, s, material, scene, lights, ambient, recurse_level);
+  }
+}
+
+void a4_set_pixel(const RenderData& d, int x, int y, const Colour& colour)
+{
+  d.img(x, y - d.img_y0, 0) = colour.R();
+  d.img(x, y - d.img_y0, 1) = colour.G();
+  d.img(x, y - d.img_y0, 2) = colour.B();
+}
+
+Ray a4_primary_ray(const RenderData& d, double x, double y)
+{
+  // Unproject the pixel to the projection plane
+  Point3D pixel (x, y, 0.0);
+  Point3D p = d.unproject * pixel;
+
+  // Create the ray with origin at the eye point
+  return Ray(d.eye, p-d.eye);
+}
+
+Colour a4_background(const RenderData& d, double x, double y)
+{
+  // Samples between pixels take the background of the pixel they're closest to
+  int px = (int)floor(x + 0.5), py = (int)floor(y + 0.5);
+  return ((px+py) & 0x10) ? (double)py/d.height * Colour(1.0, 1.0, 1.0) : Colour(0.0, 0.0, 0.0);
+}
+
+Colour a4_trace_sample(const RenderData& d, double x, double y)
+{
+  return a4_trace_ray(a4_primary_ray(d, x, y), d.scene, d.lights, d.ambient, a4_background(d, x, y), 1);
+}
+
+// Traces primary rays through an nx x ny grid of points on the image plane, step pixels apart starting at (x, y),
+// and stores their colours a row at a time
+void a4_trace_grid(const RenderData& d, double x, double y, double step, int nx, int ny, Colour* colours)
+{
+  // Primary rays are traced a packet at a time. They all leave the eye through neighbouring pixels so they tend
+  // to visit the same BVH nodes and hit the same primitives. Shadow and reflection rays go off in every direction
+  // so those are still traced one at a time by a4_shade
+  for (int gy = 0; gy < ny; gy += RAY_PACKET_HEIGHT) {
+    for (int gx = 0; gx < nx; gx += RAY_PACKET_WIDTH) {
+      RayPacket packet;
+      int hits[RayPacket::SIZE];
+
+      // Lanes that fall off the edge of the grid get a copy of a real ray but never hit anything
+      for (int k = 0; k < RayPacket::SIZE; k++) {
+        int i = gx + k % RAY_PACKET_WIDTH, j = gy + k / RAY_PACKET_WIDTH;
+        bool inside = i < nx && j < ny;
+        packet.set(k, a4_primary_ray(d, x + step*std::min(i, nx - 1), y + step*std::min(j, ny - 1)), inside ? std::numeric_limits<double>::infinity() : -1.0);
+        hits[k] = -1;
+      }
+      packet.update();
+
+      d.scene->intersect(packet, hits);
+
+      for (int k = 0; k < RayPacket::SIZE; k++) {
+        int i = gx + k % RAY_PACKET_WIDTH, j = gy + k / RAY_PACKET_WIDTH;
+        if (i >= nx || j >= ny) continue;
+
+        double sx = x + step*i, sy = y + step*j;
+        Ray ray = a4_primary_ray(d, sx, sy);
+
+        // Background colour. Used if the ray doesn't hit anything
+        Colour bg = a4_background(d, sx, sy);
+
+        // The packet only finds which instance each ray hits. The scalar test against that one instance fills in
+        // the hit point and normal, and if rounding makes it disagree the ray is just traced again on its own
+        Colour colour = bg;
+        if (hits[k] >= 0) {
+          Intersection i;
+          if (d.scene->intersect(ray, hits[k], i)) {
+            t_rays++;
+            colour = a4_shade(ray, d.scene->get_surface(ray, i), d.scene, d.lights, d.ambient, 1);
+          } else {
+            colour = a4_trace_ray(ray, d.scene, d.lights, d.ambient, bg, 1);
+          }
+        } else {
+          t_rays++;
+        }
+
+        colours[j*nx + i] = colour;
+      }
     }
+  }
+}
 
-    // Cast reflection rays and add the colour returned to render reflections on object
-    Colour reflected_colour(0.0, 0.0, 0.0);
-    if(recurse_level > 0) 
-    {
-      Ray reflected_ray(hit, ray.direction() - 2*ray.direction().dot(i.n)*i.n);
-      reflected_colour = a4_trace_ray(reflected_ray, root, lights, ambient, reflected_colour, --recurse_level);
+// Largest difference between the colours in any one channel
+static double a4_contrast(const Colour* c, int n)
+{
+  double contrast = 0.0;
+  for (int k = 1; k < n; k++) {
+    for (int a = 0; a < k; a++) {
+      contrast = std::max(contrast, std::max(fabs(c[k].R() - c[a].R()), std::max(fabs(c[k].G() - c[a].G()), fabs(c[k].B() - c[a].B()))));
     }
+  }
+  return contrast;
+}
 
-    // Add the reflection. A coefficient is multiplied with the colour to damp the saturation due to multiple light sources
-    colour = colour + (1.0 / lights.size()) * reflected_colour * material->specular();
+// Average colour over the size x size square with corners (x, y) and (x + size, y + size), given the colours at
+// its corners in the order top left, top right, bottom left, bottom right. If the corners don't agree the square
+// is split into four, which takes five new samples, and each quarter is averaged the same way
+Colour a4_adaptive_sample(const RenderData& d, double x, double y, double size, const Colour* corners, int depth, long long& samples)
+{
+  if (depth >= d.options.aa_depth || a4_contrast(corners, 4) <= d.options.aa_threshold) {
+    return 0.25 * (corners[0] + corners[1] + corners[2] + corners[3]);
   }
 
-  return colour;
+  double h = 0.5 * size;
+  Colour top = a4_trace_sample(d, x + h, y);
+  Colour left = a4_trace_sample(d, x, y + h);
+  Colour centre = a4_trace_sample(d, x + h, y + h);
+  Colour right = a4_trace_sample(d, x + size, y + h);
+  Colour bottom = a4_trace_sample(d, x + h, y + size);
+  samples += 5;
+
+  Colour q0[4] = {corners[0], top, left, centre};
+  Colour q1[4] = {top, corners[1], centre, right};
+  Colour q2[4] = {left, centre, corners[2], bottom};
+  Colour q3[4] = {centre, right, bottom, corners[3]};
+  return 0.25 * (a4_adaptive_sample(d, x, y, h, q0, depth + 1, samples) +
+                 a4_adaptive_sample(d, x + h, y, h, q1, depth + 1, samples) +
+                 a4_adaptive_sample(d, x, y + h, h, q2, depth + 1, samples) +
+                 a4_adaptive_sample(d, x + h, y + h, h, q3, depth + 1, samples));
+}
+
+// One of the coarse passes of a progressive render. Traces the pixels on a grid stride pixels apart that weren't on
+// the twice as sparse grid of the pass before, and paints the stride x stride block below and to the right of each
+// one with its colour. Tiles start on multiples of every stride so the blocks never cross into another tile
+void a4_render_tile_coarse(const RenderData& d, int x0, int y0, int x1, int y1, int stride, bool first)
+{
+  long long traced = 0;
+
+  for (int y = y0; y < y1; y += stride) {
+    for (int x = x0; x < x1; x += stride) {
+      if (!first && x % (2*stride) == 0 && y % (2*stride) == 0) continue;
+
+      Colour colour = a4_trace_sample(d, x, y);
+      traced++;
+
+      for (int by = y; by < std::min(y + stride, y1); by++) {
+        for (int bx = x; bx < std::min(x + stride, x1); bx++) {
+          a4_set_pixel(d, bx, by, colour);
+        }
+      }
+    }
+  }
+
+  d.samples += traced;
+  d.progress.add(traced, t_rays);
+  t_rays = 0;
 }
 
-void* a4_render_thread(void* data)
+void a4_render_tile(const RenderData& d, int x0, int y0, int x1, int y1)
 {
-  RenderThreadData d = *static_cast<RenderThreadData*>(data);
-
-  int one_percent = d.width * d.height * 0.01;
-  int pixel_count = 0, percentage = 0;
-
-  for (int y = d.ystart; y < d.height; y += d.yskip) {
-    for (int x = 0; x < d.width; x++) {
-      // Unproject the pixel to the projection plane
-      Point3D pixel (x, y, 0.0);
-      Point3D p = d.unproject * pixel;
-
-      // Create the ray with origin at the eye point
-      Ray ray(d.eye, p-d.eye);
-
-      // Background colour. a4_trace_ray returns this if no intersections
-      Colour bg = ((x+y) & 0x10) ? (double)y/d.height * Colour(1.0, 1.0, 1.0) : Colour(0.0, 0.0, 0.0);
-
-      // Cast a ray into the scene and get the colour returned
-      Colour colour(0.0, 0.0, 0.0);
-      colour = a4_trace_ray(ray, d.root, d.lights, d.ambient, bg, 1);
-      
-      d.img(x, y, 0) = colour.R();
-      d.img(x, y, 1) = colour.G();
-      d.img(x, y, 2) = colour.B();
-
-      if(++pixel_count >= one_percent)
-      {
-        pixel_count = 0;
-        *d.progress = ++percentage;
+  int w = x1 - x0, h = y1 - y0;
+  long long samples;
+
+  if (!d.options.antialias) {
+    // One sample per pixel
+    std::vector<Colour> colours(w * h, Colour(0.0));
+    a4_trace_grid(d, x0, y0, 1.0, w, h, &colours[0]);
+    samples = w * h;
+
+    for (int y = y0; y < y1; y++) {
+      for (int x = x0; x < x1; x++) {
+        const Colour& colour = colours[(y - y0)*w + x - x0];
+        a4_set_pixel(d, x, y, colour);
+      }
+    }
+  } else {
+    // Sample the corners of every pixel, which are shared with its neighbours, then only take more samples
+    // inside pixels that straddle an edge. Pixel (x, y) covers the square from (x - 0.5, y - 0.5) to
+    // (x + 0.5, y + 0.5), so it's centred where the single sample would have been
+    std::vector<Colour> corners((w + 1) * (h + 1), Colour(0.0));
+    a4_trace_grid(d, x0 - 0.5, y0 - 0.5, 1.0, w + 1, h + 1, &corners[0]);
+    samples = (w + 1) * (h + 1);
+
+    for (int y = y0; y < y1; y++) {
+      for (int x = x0; x < x1; x++) {
+        int k = (y - y0)*(w + 1) + x - x0;
+        Colour c[4] = {corners[k], corners[k + 1], corners[k + w + 1], corners[k + w + 2]};
+        Colour colour = a4_adaptive_sample(d, x - 0.5, y - 0.5, 1.0, c, 0, samples);
+        a4_set_pixel(d, x, y, colour);
       }
     }
   }
-  *d.done = true;
 
-  return NULL;
+  d.samples += samples;
+  d.progress.add(w * h, t_rays);
+  t_rays = 0;
 }
 
 void a4_render(// What to render
@@ -183,7 +370,9 @@ void a4_render(// What to render
                const Vector3D& up, double fov,
                // Lighting parameters
                const Colour& ambient,
-               const std::list<Light*>& lights
+               const std::list<Light*>& lights,
+               // Everything else
+               const RenderOptions& options
                )
 {
   // Fill in raytracing code here.
@@ -199,60 +388,156 @@ void a4_render(// What to render
   }
   std::cerr << "});" << std::endl;
 
+  // Flatten the scene graph into world space and build a BVH over it so rays don't have to walk the hierarchy
+  SceneBVH scene(root);
+  std::cout << "Built BVH over " << scene.size() << " instances: " << scene.bvh().stats() << std::endl;
+
   // Get pixel unprojection matrix
   double d = view.length();
-  Matrix4x4 unproject = a4_get_unproject_matrix(width, height, fov, d, eye, view, up);
+  Affine3x4 unproject = a4_get_unproject_matrix(width, height, fov, d, eye, view, up);
     
-  Image img(width, height, 3);
+  // A streamed render only keeps band_rows rows of the image in memory, in two bands so the workers can render
+  // one while the main thread compresses and writes out the one before. Bands are a whole number of tiles tall
+  bool streamed = options.band_rows > 0 && options.band_rows < height;
+  int band_rows = streamed ? (options.band_rows + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE : height;
+  bool progressive = options.progressive;
+  if (streamed && progressive) {
+    std::cout << "Progressive rendering needs the whole image in memory, rendering without it" << std::endl;
+    progressive = false;
+  }
 
-  int progress1 = 0, progress2 = 0, progress3 = 0, progress4 = 0;
-  bool done1 = false, done2 = false, done3 = false, done4 = false;
-  RenderThreadData data1 = {img, 0, 4, width, height, root, unproject, eye, ambient, lights, &progress1, &done1};
-  RenderThreadData data2 = {img, 1, 4, width, height, root, unproject, eye, ambient, lights, &progress2, &done2};
-  RenderThreadData data3 = {img, 2, 4, width, height, root, unproject, eye, ambient, lights, &progress3, &done3};
-  RenderThreadData data4 = {img, 3, 4, width, height, root, unproject, eye, ambient, lights, &progress4, &done4};
+  Image img(width, std::min(band_rows, height), 3);
+  Image spare(streamed ? width : 0, streamed ? img.height() : 0, 3);
+  Image* bands[2] = {&img, &spare};
 
-  pthread_t t1, t2, t3, t4;
+  // Split the image into tiles and hand them all to the thread pool. Each worker starts on its own share of
+  // the tiles and steals from the others when it runs out, so expensive parts of the image get spread around
+  ThreadPool& pool = render_pool();
+  std::cout << "Rendering on " << pool.size() << " threads" << std::endl;
 
-  int ret = pthread_create(&t1, NULL, a4_render_thread, &data1);
-  if(ret)
-  {
-    std::cerr << "Abort: pthread_create failed with error code: " << ret << std::endl;
-    exit(EXIT_FAILURE);
-  }
+  PngOptions png = options.png;
+  png.pool = &pool;
 
-  ret = pthread_create(&t2, NULL, a4_render_thread, &data2);
-  if(ret)
-  {
-    std::cerr << "Abort: pthread_create failed with error code: " << ret << std::endl;
-    exit(EXIT_FAILURE);
+  PngWriter writer;
+  if (streamed && !writer.open(filename, width, height, 3, png)) {
+    std::cerr << "Couldn't write " << filename << std::endl;
+    return;
   }
 
-  ret = pthread_create(&t3, NULL, a4_render_thread, &data3);
-  if(ret)
-  {
-    std::cerr << "Abort: pthread_create failed with error code: " << ret << std::endl;
-    exit(EXIT_FAILURE);
+  // The coarse passes of a progressive render trace every COARSE_STRIDE'th pixel in each direction between them
+  long long total = (long long)width * height;
+  if (progressive) total += (long long)((width + COARSE_STRIDE - 1) / COARSE_STRIDE) * ((height + COARSE_STRIDE - 1) / COARSE_STRIDE);
+
+  Progress progress(pool.size(), total);
+  std::atomic<long long> samples(0);
+
+  std::string preview = options.preview;
+  if (preview.empty()) {
+    size_t dot = filename.rfind('.');
+    preview = (dot == std::string::npos) ? filename + "-preview" : filename.substr(0, dot) + "-preview" + filename.substr(dot);
   }
+  std::chrono::steady_clock::time_point last_preview = std::chrono::steady_clock::now();
+  std::chrono::duration<double> preview_interval(options.preview_interval);
+
+  // Previews are only ever written from pixels no worker is still writing. Between the coarse passes of a
+  // progressive render that's the whole image. During the final pass it's the tiles the workers have finished,
+  // which they flag after their last pixel is written, copied over the last coarse pass into an image of its own
+  int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE, tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+  std::vector<std::atomic<bool> > tile_done(progressive ? tiles_x * tiles_y : 0);
+  for (auto& done : tile_done) done.store(false, std::memory_order_relaxed);
+  std::vector<bool> tile_copied(tile_done.size(), false);
+  Image shown;
+  bool preview_tiles = false;
+
+  auto save_tile_preview = [&] {
+    for (size_t t = 0; t < tile_done.size(); t++) {
+      if (tile_copied[t] || !tile_done[t].load(std::memory_order_acquire)) continue;
+      int x0 = (t % tiles_x) * TILE_SIZE, y0 = (t / tiles_x) * TILE_SIZE;
+      for (int y = y0; y < std::min(y0 + TILE_SIZE, height); y++) {
+        for (int x = x0; x < std::min(x0 + TILE_SIZE, width); x++) {
+          for (int i = 0; i < 3; i++) shown(x, y, i) = img(x, y, i);
+        }
+      }
+      tile_copied[t] = true;
+    }
+    shown.savePng(preview, png);
+    last_preview = std::chrono::steady_clock::now();
+  };
+
+  // Sleep while the workers render, waking up every so often to print how far along they are and, during the
+  // final pass of a progressive render, write out the tiles finished so far
+  auto wait = [&] {
+    while(!pool.wait_for(PROGRESS_INTERVAL))
+    {
+      progress.report(std::cout);
+      if (preview_tiles && std::chrono::steady_clock::now() - last_preview >= preview_interval) save_tile_preview();
+    }
+  };
+
+  // Each coarse pass has to finish before the next one starts or its big blocks could paint over the
+  // finer ones. A preview is written as soon as the first one is done so there's something to look at
+  if (progressive) {
+    RenderData data = {img, 0, width, height, &scene, unproject, eye, ambient, lights, options, progress, samples};
+    for (int stride = COARSE_STRIDE_START; stride >= COARSE_STRIDE; stride /= 2) {
+      for (int y0 = 0; y0 < height; y0 += TILE_SIZE) {
+        for (int x0 = 0; x0 < width; x0 += TILE_SIZE) {
+          int x1 = std::min(x0 + TILE_SIZE, width), y1 = std::min(y0 + TILE_SIZE, height);
+          bool first = stride == COARSE_STRIDE_START;
+          pool.submit([&data, x0, y0, x1, y1, stride, first] {
+            a4_render_tile_coarse(data, x0, y0, x1, y1, stride, first);
+          });
+        }
+      }
+      wait();
 
-  ret = pthread_create(&t4, NULL, a4_render_thread, &data4);
-  if(ret)
-  {
-    std::cerr << "Abort: pthread_create failed with error code: " << ret << std::endl;
-    exit(EXIT_FAILURE);
+      // Nothing is being written now the pass is done, so the image can be saved as it is
+      if (stride == COARSE_STRIDE_START || std::chrono::steady_clock::now() - last_preview >= preview_interval) {
+        img.savePng(preview, png);
+        last_preview = std::chrono::steady_clock::now();
+      }
+    }
+
+    shown = img;
+    preview_tiles = true;
   }
 
-  while(!done1 || !done2 || !done3 || !done4)
-  {
-    std::cout << "progress: " << progress1+progress2+progress3+progress4 << "% \r" << std::flush;
+  // Without streaming the whole image is one band
+  bool written = true;
+  const Image* finished = 0;
+  int finished_rows = 0;
+  for (int b0 = 0; b0 < height; b0 += band_rows) {
+    int b1 = std::min(b0 + band_rows, height);
+    Image& band = *bands[(b0 / band_rows) % 2];
+    RenderData data = {band, b0, width, height, &scene, unproject, eye, ambient, lights, options, progress, samples};
+
+    for (int y0 = b0; y0 < b1; y0 += TILE_SIZE) {
+      for (int x0 = 0; x0 < width; x0 += TILE_SIZE) {
+        int x1 = std::min(x0 + TILE_SIZE, width), y1 = std::min(y0 + TILE_SIZE, b1);
+        std::atomic<bool>* done = progressive ? &tile_done[(y0 / TILE_SIZE) * tiles_x + x0 / TILE_SIZE] : 0;
+        pool.submit([&data, x0, y0, x1, y1, done] {
+          a4_render_tile(data, x0, y0, x1, y1);
+          if (done) done->store(true, std::memory_order_release);
+        });
+      }
+    }
+
+    if (finished) written = writer.write_rows(*finished, finished_rows) && written;
+    wait();
+
+    if (streamed) {
+      finished = &band;
+      finished_rows = b1 - b0;
+    }
   }
-  std::cout << std::endl;
-  
-  pthread_join(t1, NULL);
-  pthread_join(t2, NULL);
-  pthread_join(t3, NULL);
-  pthread_join(t4, NULL);
 
-  img.savePng(filename);
-  
+  progress.finish(std::cout);
+  std::cout << "Average samples per pixel: " << (double)samples / ((double)width * height) << std::endl;
+
+  if (streamed) {
+    written = writer.write_rows(*finished, finished_rows) && written;
+    written = writer.close() && written;
+  } else {
+    written = img.savePng(filename, png);
+  }
+  if (!written) std::cerr << "Couldn't write " << filename << std::endl;
 }
@@ -5,6 +5,40 @@
 #include "algebra.hpp"
 #include "scene.hpp"
 #include "light.hpp"
+#include "image.hpp"
+
+// Settings for a render that have sensible defaults, given to gr.render as an optional table after the lights
+struct RenderOptions {
+  RenderOptions()
+    : antialias(false)
+    , aa_threshold(0.1)
+    , aa_depth(2)
+    , progressive(false)
+    , preview_interval(10.0)
+    , band_rows(0)
+  {}
+
+  // Adaptive antialiasing. Pixels are sampled at their corners and any pixel whose corners differ by more
+  // than aa_threshold in some channel is split into four and sampled again, up to aa_depth times
+  bool antialias;
+  double aa_threshold;
+  int aa_depth;
+
+  // Progressive rendering. A few quick passes over sparser and sparser grids of pixels come first, each pixel
+  // painted over the block around it, then the full render refines the image. Snapshots of the image so far
+  // are written to preview (by default the output file name with -preview added) every preview_interval seconds
+  bool progressive;
+  double preview_interval;
+  std::string preview;
+
+  // Streamed rendering for images too big to keep in memory. The image is rendered band_rows rows at a time
+  // and each band is written to the PNG file as soon as it is done. 0 renders the whole image at once
+  int band_rows;
+
+  // How the output (and preview) PNG files are compressed. The strips of each image are compressed on the
+  // render threads
+  PngOptions png;
+};
 
 void a4_render(// What to render
                SceneNode* root,
@@ -17,7 +51,9 @@ void a4_render(// What to render
                const Vector3D& up, double fov,
                // Lighting parameters
                const Colour& ambient,
-               const std::list<Light*>& lights
+               const std::list<Light*>& lights,
+               // Everything else
+               const RenderOptions& options = RenderOptions()
                );
 
 #endif
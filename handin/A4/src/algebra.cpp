@@ -14,12 +14,13 @@
 
 #include "algebra.hpp"
 
-double Vector3D::normalize()
+template<typename T>
+T BasicVector3D<T>::normalize()
 {
-  double denom = 1.0;
-  double x = (v_[0] > 0.0) ? v_[0] : -v_[0];
-  double y = (v_[1] > 0.0) ? v_[1] : -v_[1];
-  double z = (v_[2] > 0.0) ? v_[2] : -v_[2];
+  T denom = 1.0;
+  T x = (v_[0] > 0.0) ? v_[0] : -v_[0];
+  T y = (v_[1] > 0.0) ? v_[1] : -v_[1];
+  T z = (v_[2] > 0.0) ? v_[2] : -v_[2];
 
   if(x > y) {
     if(x > z) {
@@ -65,7 +66,8 @@ double Vector3D::normalize()
  * Define some helper functions for matrix inversion.
  */
 
-static void swaprows(Matrix4x4& a, size_t r1, size_t r2)
+template<typename T>
+static void swaprows(BasicMatrix4x4<T>& a, size_t r1, size_t r2)
 {
   std::swap(a[r1][0], a[r2][0]);
   std::swap(a[r1][1], a[r2][1]);
@@ -73,7 +75,8 @@ static void swaprows(Matrix4x4& a, size_t r1, size_t r2)
   std::swap(a[r1][3], a[r2][3]);
 }
 
-static void dividerow(Matrix4x4& a, size_t r, double fac)
+template<typename T>
+static void dividerow(BasicMatrix4x4<T>& a, size_t r, T fac)
 {
   a[r][0] /= fac;
   a[r][1] /= fac;
@@ -81,7 +84,8 @@ static void dividerow(Matrix4x4& a, size_t r, double fac)
   a[r][3] /= fac;
 }
 
-static void submultrow(Matrix4x4& a, size_t dest, size_t src, double fac)
+template<typename T>
+static void submultrow(BasicMatrix4x4<T>& a, size_t dest, size_t src, T fac)
 {
   a[dest][0] -= fac * a[src][0];
   a[dest][1] -= fac * a[src][1];
@@ -96,13 +100,14 @@ static void submultrow(Matrix4x4& a, size_t dest, size_t src, double fac)
  * from a different school.  I taught that course too, so I figured it
  * would be okay.
  */
-Matrix4x4 Matrix4x4::invert() const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::invert() const
 {
   /* The algorithm is plain old Gauss-Jordan elimination 
      with partial pivoting. */
 
-  Matrix4x4 a(*this);
-  Matrix4x4 ret;
+  BasicMatrix4x4 a(*this);
+  BasicMatrix4x4 ret;
 
   /* Loop over cols of a from left to right, 
      eliminating above and below diag */
@@ -142,42 +147,45 @@ Matrix4x4 Matrix4x4::invert() const
   return ret;
 }
 
-Matrix4x4 Matrix4x4::translate(double x, double y, double z) const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::translate(T x, T y, T z) const
 {
-  Matrix4x4 t;
+  BasicMatrix4x4 t;
   t.v_[3] = x;
   t.v_[7] = y;
   t.v_[11] = z;
   return (*this) * t;
 }
 
-Matrix4x4 Matrix4x4::translate(const Vector3D& v) const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::translate(const BasicVector3D<T>& v) const
 {
   return translate(v[0], v[1], v[2]);
 }
 
-Matrix4x4 Matrix4x4::rotate(double angle, double x, double y, double z) const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::rotate(T angle, T x, T y, T z) const
 {
-  Matrix4x4 r;
+  BasicMatrix4x4 r;
 
   // Calculate angle in radians
   angle = angle * M_PI / 180.0f;
 
   // Calculate constant values
-  double c = cos(angle);
-  double s = sin(angle);
-  double oc = 1 - c;
+  T c = cos(angle);
+  T s = sin(angle);
+  T oc = 1 - c;
   
-  double xxoc = x*x*oc;
-  double xyoc = x*y*oc;
-  double xzoc = x*z*oc;
-  double yyoc = y*y*oc;
-  double yzoc = y*z*oc;
-  double zzoc = z*z*oc;
+  T xxoc = x*x*oc;
+  T xyoc = x*y*oc;
+  T xzoc = x*z*oc;
+  T yyoc = y*y*oc;
+  T yzoc = y*z*oc;
+  T zzoc = z*z*oc;
 
-  double xs = x*s;
-  double ys = y*s;
-  double zs = z*s;
+  T xs = x*s;
+  T ys = y*s;
+  T zs = z*s;
 
   // Apply the rotation to the arbitrary axis
   r.v_[0] = xxoc+c;
@@ -193,14 +201,16 @@ Matrix4x4 Matrix4x4::rotate(double angle, double x, double y, double z) const
   return (*this) * r;
 }
 
-Matrix4x4 Matrix4x4::rotate(double angle, const Vector3D& v) const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::rotate(T angle, const BasicVector3D<T>& v) const
 {
   return rotate(angle, v[0], v[1], v[2]);
 }
 
-Matrix4x4 Matrix4x4::scale(double x, double y, double z) const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::scale(T x, T y, T z) const
 {
-  Matrix4x4 s;
+  BasicMatrix4x4 s;
 
   s.v_[0] = x;
   s.v_[5] = y;
@@ -209,8 +219,102 @@ Matrix4x4 Matrix4x4::scale(double x, double y, double z) const
   return (*this) * s;
 }
 
-Matrix4x4 Matrix4x4::scale(const Vector3D& v) const
+template<typename T>
+BasicMatrix4x4<T> BasicMatrix4x4<T>::scale(const BasicVector3D<T>& v) const
 {
   return scale(v[0], v[1], v[2]);
 }
 
+template<typename T>
+BasicAffine3x4<T> BasicAffine3x4<T>::invert() const
+{
+  // The inverse of [L t] is [L^-1 -L^-1 t]. L^-1 is the transposed matrix of cofactors of L over its determinant
+  const T* a = v_;
+  BasicAffine3x4 ret;
+
+  T c00 = a[5]*a[10] - a[6]*a[9];
+  T c01 = a[6]*a[8] - a[4]*a[10];
+  T c02 = a[4]*a[9] - a[5]*a[8];
+
+  T det = a[0]*c00 + a[1]*c01 + a[2]*c02;
+  if(det == 0.0) {
+    // Theoretically throw an exception.
+    return ret;
+  }
+  T inv = 1.0 / det;
+
+  ret.v_[0] = c00 * inv;
+  ret.v_[1] = (a[2]*a[9] - a[1]*a[10]) * inv;
+  ret.v_[2] = (a[1]*a[6] - a[2]*a[5]) * inv;
+  ret.v_[4] = c01 * inv;
+  ret.v_[5] = (a[0]*a[10] - a[2]*a[8]) * inv;
+  ret.v_[6] = (a[2]*a[4] - a[0]*a[6]) * inv;
+  ret.v_[8] = c02 * inv;
+  ret.v_[9] = (a[1]*a[8] - a[0]*a[9]) * inv;
+  ret.v_[10] = (a[0]*a[5] - a[1]*a[4]) * inv;
+
+  for(size_t r = 0; r < 3; ++r) {
+    const T* row = ret[r];
+    ret.v_[4*r+3] = -(row[0] * a[3] + row[1] * a[7] + row[2] * a[11]);
+  }
+
+  return ret;
+}
+
+template<typename T>
+BasicAffine3x4<T> BasicAffine3x4<T>::translate(T x, T y, T z) const
+{
+  // Only the translation column changes, it picks up the linear part applied to (x, y, z)
+  BasicAffine3x4 ret(*this);
+  for(size_t r = 0; r < 3; ++r) {
+    ret.v_[4*r+3] += v_[4*r] * x + v_[4*r+1] * y + v_[4*r+2] * z;
+  }
+  return ret;
+}
+
+template<typename T>
+BasicAffine3x4<T> BasicAffine3x4<T>::translate(const BasicVector3D<T>& v) const
+{
+  return translate(v[0], v[1], v[2]);
+}
+
+template<typename T>
+BasicAffine3x4<T> BasicAffine3x4<T>::rotate(T angle, T x, T y, T z) const
+{
+  // Same rotation as the Matrix4x4 version
+  BasicMatrix4x4<T> r = BasicMatrix4x4<T>().rotate(angle, x, y, z);
+  return (*this) * BasicAffine3x4(r);
+}
+
+template<typename T>
+BasicAffine3x4<T> BasicAffine3x4<T>::rotate(T angle, const BasicVector3D<T>& v) const
+{
+  return rotate(angle, v[0], v[1], v[2]);
+}
+
+template<typename T>
+BasicAffine3x4<T> BasicAffine3x4<T>::scale(T x, T y, T z) const
+{
+  // Scales the columns of the linear part
+  BasicAffine3x4 ret(*this);
+  for(size_t r = 0; r < 3; ++r) {
+    ret.v_[4*r] *= x;
+    ret.v_[4*r+1] *= y;
+    ret.v_[4*r+2] *= z;
+  }
+  return ret;
+}
+
+template<typename T>
+BasicAffine3x4<T> BasicAffine3x4<T>::scale(const BasicVector3D<T>& v) const
+{
+  return scale(v[0], v[1], v[2]);
+}
+
+// The out of line members are only needed for the two precisions the renderer uses
+template class BasicVector3D<double>;
+template class BasicVector3D<float>;
+template class BasicMatrix4x4<double>;
+template class BasicMatrix4x4<float>;
+template class BasicAffine3x4<double>;
+template class BasicAffine3x4<float>;
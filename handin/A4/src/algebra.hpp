@@ -19,287 +19,295 @@
 #include <algorithm>
 #include <cmath>
 #include <limits>
+#include "simd.hpp"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
-class Material;
-
-class Point2D
+template<typename T>
+class BasicPoint2D
 {
 public:
-  Point2D()
+  typedef T Scalar;
+
+  BasicPoint2D()
   {
     v_[0] = 0.0;
     v_[1] = 0.0;
   }
-  Point2D(double x, double y)
+  BasicPoint2D(T x, T y)
   { 
     v_[0] = x;
     v_[1] = y;
   }
-  Point2D(const Point2D& other)
+  BasicPoint2D(const BasicPoint2D& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
   }
 
-  Point2D& operator =(const Point2D& other)
+  BasicPoint2D& operator =(const BasicPoint2D& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
     return *this;
   }
 
-  double& operator[](size_t idx) 
+  T& operator[](size_t idx) 
   {
     return v_[ idx ];
   }
-  double operator[](size_t idx) const 
+  T operator[](size_t idx) const 
   {
     return v_[ idx ];
   }
 
 private:
-  double v_[2];
+  T v_[2];
 };
 
-class Point3D
+template<typename T>
+class BasicPoint3D
 {
 public:
-  Point3D()
+  typedef T Scalar;
+
+  BasicPoint3D()
   {
     v_[0] = 0.0;
     v_[1] = 0.0;
     v_[2] = 0.0;
   }
-  Point3D(double x, double y, double z)
+  BasicPoint3D(T x, T y, T z)
   { 
     v_[0] = x;
     v_[1] = y;
     v_[2] = z;
   }
-  Point3D(const Point3D& other)
+  template<typename U>
+  explicit BasicPoint3D(const BasicPoint3D<U>& other)
   {
-    v_[0] = other.v_[0];
-    v_[1] = other.v_[1];
-    v_[2] = other.v_[2];
+    v_[0] = other[0];
+    v_[1] = other[1];
+    v_[2] = other[2];
   }
-  Point3D(const Point2D& other, double z)
+  BasicPoint3D(const BasicPoint2D<T>& other, T z)
   {
     v_[0] = other[0];
     v_[1] = other[1];
     v_[2] = z;
   }
-  Point3D(const Point2D& other)
+  BasicPoint3D(const BasicPoint2D<T>& other)
   {
     v_[0] = other[0];
     v_[1] = other[1];
     v_[2] = 0.0;
   }
 
-  Point3D& operator =(const Point3D& other)
-  {
-    v_[0] = other.v_[0];
-    v_[1] = other.v_[1];
-    v_[2] = other.v_[2];
-    return *this;
-  }
-
-  double& operator[](size_t idx) 
+  T& operator[](size_t idx) 
   {
     return v_[ idx ];
   }
-  double operator[](size_t idx) const 
+  T operator[](size_t idx) const 
   {
     return v_[ idx ];
   }
 
 private:
-  double v_[3];
+  T v_[3];
 };
 
-class Vector3D
+template<typename T>
+class BasicVector3D
 {
 public:
-  Vector3D()
+  typedef T Scalar;
+
+  BasicVector3D()
   {
     v_[0] = 0.0;
     v_[1] = 0.0;
     v_[2] = 0.0;
   }
-  Vector3D(double x, double y, double z)
+  BasicVector3D(T x, T y, T z)
   { 
     v_[0] = x;
     v_[1] = y;
     v_[2] = z;
   }
-  Vector3D(const Vector3D& other)
+  template<typename U>
+  explicit BasicVector3D(const BasicVector3D<U>& other)
   {
-    v_[0] = other.v_[0];
-    v_[1] = other.v_[1];
-    v_[2] = other.v_[2];
+    v_[0] = other[0];
+    v_[1] = other[1];
+    v_[2] = other[2];
   }
-  Vector3D(const Point3D& other)
+  BasicVector3D(const BasicPoint3D<T>& other)
   {
     v_[0] = other[0];
     v_[1] = other[1];
     v_[2] = other[2];
   }
-  Vector3D(const Point2D& other, double z)
+  BasicVector3D(const BasicPoint2D<T>& other, T z)
   {
     v_[0] = other[0];
     v_[1] = other[1];
     v_[2] = z;
   }
-  Vector3D(const Point2D& other)
+  BasicVector3D(const BasicPoint2D<T>& other)
   {
     v_[0] = other[0];
     v_[1] = other[1];
     v_[2] = 0.0;
   }
 
-  Vector3D& operator =(const Vector3D& other)
-  {
-    v_[0] = other.v_[0];
-    v_[1] = other.v_[1];
-    v_[2] = other.v_[2];
-    return *this;
-  }
-
-  double& operator[](size_t idx) 
+  T& operator[](size_t idx) 
   {
     return v_[ idx ];
   }
-  double operator[](size_t idx) const 
+  T operator[](size_t idx) const 
   {
     return v_[ idx ];
   }
 
-  double dot(const Vector3D& other) const
+  T dot(const BasicVector3D& other) const
   {
     return v_[0]*other.v_[0] + v_[1]*other.v_[1] + v_[2]*other.v_[2];
   }
 
-  double length2() const
+  T length2() const
   {
     return v_[0]*v_[0] + v_[1]*v_[1] + v_[2]*v_[2];
   }
-  double length() const
+  T length() const
   {
     return sqrt(length2());
   }
 
-  double normalize();
+  T normalize();
 
-  Vector3D normalized() const
+  BasicVector3D normalized() const
   {
-    Vector3D v(v_[0], v_[1], v_[2]);
+    BasicVector3D v(v_[0], v_[1], v_[2]);
     v.normalize();
     return v;
   }
 
-  Vector3D cross(const Vector3D& other) const
+  BasicVector3D cross(const BasicVector3D& other) const
   {
-    return Vector3D(v_[1]*other[2] - v_[2]*other[1],
-                    v_[2]*other[0] - v_[0]*other[2],
-                    v_[0]*other[1] - v_[1]*other[0]);
+    return BasicVector3D(v_[1]*other[2] - v_[2]*other[1],
+                         v_[2]*other[0] - v_[0]*other[2],
+                         v_[0]*other[1] - v_[1]*other[0]);
   }
 
 private:
-  double v_[3];
+  T v_[3];
 };
 
-inline Vector3D operator *(double s, const Vector3D& v)
+template<typename T>
+inline BasicVector3D<T> operator *(typename BasicVector3D<T>::Scalar s, const BasicVector3D<T>& v)
 {
-  return Vector3D(s*v[0], s*v[1], s*v[2]);
+  return BasicVector3D<T>(s*v[0], s*v[1], s*v[2]);
 }
 
-inline Vector3D operator +(const Vector3D& a, const Vector3D& b)
+template<typename T>
+inline BasicVector3D<T> operator +(const BasicVector3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Vector3D(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
+  return BasicVector3D<T>(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
 }
 
-inline Point3D operator +(const Point3D& a, const Vector3D& b)
+template<typename T>
+inline BasicPoint3D<T> operator +(const BasicPoint3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Point3D(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
+  return BasicPoint3D<T>(a[0]+b[0], a[1]+b[1], a[2]+b[2]);
 }
 
-inline Vector3D operator -(const Point3D& a, const Point3D& b)
+template<typename T>
+inline BasicVector3D<T> operator -(const BasicPoint3D<T>& a, const BasicPoint3D<T>& b)
 {
-  return Vector3D(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
+  return BasicVector3D<T>(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
 }
 
-inline Vector3D operator -(const Vector3D& a, const Vector3D& b)
+template<typename T>
+inline BasicVector3D<T> operator -(const BasicVector3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Vector3D(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
+  return BasicVector3D<T>(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
 }
 
-inline Vector3D operator -(const Vector3D& a)
+template<typename T>
+inline BasicVector3D<T> operator -(const BasicVector3D<T>& a)
 {
-  return Vector3D(-a[0], -a[1], -a[2]);
+  return BasicVector3D<T>(-a[0], -a[1], -a[2]);
 }
 
-inline Point3D operator -(const Point3D& a, const Vector3D& b)
+template<typename T>
+inline BasicPoint3D<T> operator -(const BasicPoint3D<T>& a, const BasicVector3D<T>& b)
 {
-  return Point3D(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
+  return BasicPoint3D<T>(a[0]-b[0], a[1]-b[1], a[2]-b[2]);
 }
 
-inline Vector3D cross(const Vector3D& a, const Vector3D& b) 
+template<typename T>
+inline BasicVector3D<T> cross(const BasicVector3D<T>& a, const BasicVector3D<T>& b) 
 {
   return a.cross(b);
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Point2D& p)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicPoint2D<T>& p)
 {
   return os << "p<" << p[0] << "," << p[1] << ">";
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Point3D& p)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicPoint3D<T>& p)
 {
   return os << "p<" << p[0] << "," << p[1] << "," << p[2] << ">";
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Vector3D& v)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicVector3D<T>& v)
 {
   return os << "v<" << v[0] << "," << v[1] << "," << v[2] << ">";
 }
 
-class Matrix4x4;
+template<typename T> class BasicMatrix4x4;
 
-class Vector4D
+template<typename T>
+class BasicVector4D
 {
 public:
-  Vector4D()
+  typedef T Scalar;
+
+  BasicVector4D()
   {
     v_[0] = 0.0;
     v_[1] = 0.0;
     v_[2] = 0.0;
     v_[3] = 0.0;
   }
-  Vector4D(double x, double y, double z, double w)
+  BasicVector4D(T x, T y, T z, T w)
   { 
     v_[0] = x;
     v_[1] = y;
     v_[2] = z;
     v_[3] = w;
   }
-  Vector4D(const Vector4D& other)
+  BasicVector4D(const BasicVector4D& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
     v_[2] = other.v_[2];
     v_[3] = other.v_[3];
   }
-  Vector4D(const Vector3D& other, double w)
+  BasicVector4D(const BasicVector3D<T>& other, T w)
   {
     v_[0] = other[0];
     v_[1] = other[1];
     v_[2] = other[2];
     v_[3] = w;
   }
-  Vector4D(const Vector3D& other) 
+  BasicVector4D(const BasicVector3D<T>& other) 
   {
     v_[0] = other[0];
     v_[1] = other[1];
@@ -307,7 +315,7 @@ public:
     v_[3] = 1.0;
   }
 
-  Vector4D& operator =(const Vector4D& other)
+  BasicVector4D& operator =(const BasicVector4D& other)
   {
     v_[0] = other.v_[0];
     v_[1] = other.v_[1];
@@ -316,23 +324,26 @@ public:
     return *this;
   }
 
-  double& operator[](size_t idx) 
+  T& operator[](size_t idx) 
   {
     return v_[ idx ];
   }
-  double operator[](size_t idx) const 
+  T operator[](size_t idx) const 
   {
     return v_[ idx ];
   }
 
 private:
-  double v_[4];
+  T v_[4];
 };
 
-class Matrix4x4
+template<typename T>
+class BasicMatrix4x4
 {
 public:
-  Matrix4x4()
+  typedef T Scalar;
+
+  BasicMatrix4x4()
   {
     // Construct an identity matrix
     std::fill(v_, v_+16, 0.0);
@@ -341,12 +352,12 @@ public:
     v_[10] = 1.0;
     v_[15] = 1.0;
   }
-  Matrix4x4(const Matrix4x4& other)
+  BasicMatrix4x4(const BasicMatrix4x4& other)
   {
     std::copy(other.v_, other.v_+16, v_);
   }
-  Matrix4x4(const Vector4D row1, const Vector4D row2, const Vector4D row3, 
-             const Vector4D row4)
+  BasicMatrix4x4(const BasicVector4D<T> row1, const BasicVector4D<T> row2, const BasicVector4D<T> row3, 
+                 const BasicVector4D<T> row4)
   {
     v_[0] = row1[0]; 
     v_[1] = row1[1]; 
@@ -368,73 +379,74 @@ public:
     v_[14] = row4[2]; 
     v_[15] = row4[3]; 
   }
-  Matrix4x4(double *vals)
+  BasicMatrix4x4(T *vals)
   {
-    std::copy(vals, vals + 16, (double*)v_);
+    std::copy(vals, vals + 16, (T*)v_);
   }
 
-  Matrix4x4& operator=(const Matrix4x4& other)
+  BasicMatrix4x4& operator=(const BasicMatrix4x4& other)
   {
     std::copy(other.v_, other.v_+16, v_);
     return *this;
   }
 
-  Vector4D getRow(size_t row) const
+  BasicVector4D<T> getRow(size_t row) const
   {
-    return Vector4D(v_[4*row], v_[4*row+1], v_[4*row+2], v_[4*row+3]);
+    return BasicVector4D<T>(v_[4*row], v_[4*row+1], v_[4*row+2], v_[4*row+3]);
   }
-  double *getRow(size_t row) 
+  T *getRow(size_t row) 
   {
-    return (double*)v_ + 4*row;
+    return (T*)v_ + 4*row;
   }
 
-  Vector4D getColumn(size_t col) const
+  BasicVector4D<T> getColumn(size_t col) const
   {
-    return Vector4D(v_[col], v_[4+col], v_[8+col], v_[12+col]);
+    return BasicVector4D<T>(v_[col], v_[4+col], v_[8+col], v_[12+col]);
   }
 
-  Vector4D operator[](size_t row) const
+  BasicVector4D<T> operator[](size_t row) const
   {
     return getRow(row);
   }
-  double *operator[](size_t row) 
+  T *operator[](size_t row) 
   {
     return getRow(row);
   }
 
-  Matrix4x4 transpose() const
+  BasicMatrix4x4 transpose() const
   {
-    return Matrix4x4(getColumn(0), getColumn(1), 
-                      getColumn(2), getColumn(3));
+    return BasicMatrix4x4(getColumn(0), getColumn(1), 
+                          getColumn(2), getColumn(3));
   }
-  Matrix4x4 invert() const;
+  BasicMatrix4x4 invert() const;
 
-  Matrix4x4 translate(double x, double y, double z) const;
-  Matrix4x4 translate(const Vector3D& v) const;
-  Matrix4x4 rotate(double angle, double x, double y, double z) const;
-  Matrix4x4 rotate(double angle, const Vector3D& v) const;
-  Matrix4x4 scale(double x, double y, double z) const;
-  Matrix4x4 scale(const Vector3D& v) const;
+  BasicMatrix4x4 translate(T x, T y, T z) const;
+  BasicMatrix4x4 translate(const BasicVector3D<T>& v) const;
+  BasicMatrix4x4 rotate(T angle, T x, T y, T z) const;
+  BasicMatrix4x4 rotate(T angle, const BasicVector3D<T>& v) const;
+  BasicMatrix4x4 scale(T x, T y, T z) const;
+  BasicMatrix4x4 scale(const BasicVector3D<T>& v) const;
 
-  const double *begin() const
+  const T *begin() const
   {
-    return (double*)v_;
+    return (T*)v_;
   }
-  const double *end() const
+  const T *end() const
   {
     return begin() + 16;
   }
 		
 private:
-  double v_[16];
+  T v_[16];
 };
 
-inline Matrix4x4 operator *(const Matrix4x4& a, const Matrix4x4& b)
+template<typename T>
+inline BasicMatrix4x4<T> operator *(const BasicMatrix4x4<T>& a, const BasicMatrix4x4<T>& b)
 {
-  Matrix4x4 ret;
+  BasicMatrix4x4<T> ret;
 
   for(size_t i = 0; i < 4; ++i) {
-    Vector4D row = a.getRow(i);
+    BasicVector4D<T> row = a.getRow(i);
 		
     for(size_t j = 0; j < 4; ++j) {
       ret[i][j] = row[0] * b[0][j] + row[1] * b[1][j] + 
@@ -445,28 +457,32 @@ inline Matrix4x4 operator *(const Matrix4x4& a, const Matrix4x4& b)
   return ret;
 }
 
-inline Vector3D operator *(const Matrix4x4& M, const Vector3D& v)
+template<typename T>
+inline BasicVector3D<T> operator *(const BasicMatrix4x4<T>& M, const BasicVector3D<T>& v)
 {
-  return Vector3D(v[0] * M[0][0] + v[1] * M[0][1] + v[2] * M[0][2],
-                  v[0] * M[1][0] + v[1] * M[1][1] + v[2] * M[1][2],
-                  v[0] * M[2][0] + v[1] * M[2][1] + v[2] * M[2][2]);
+  return BasicVector3D<T>(v[0] * M[0][0] + v[1] * M[0][1] + v[2] * M[0][2],
+                          v[0] * M[1][0] + v[1] * M[1][1] + v[2] * M[1][2],
+                          v[0] * M[2][0] + v[1] * M[2][1] + v[2] * M[2][2]);
 }
 
-inline Point3D operator *(const Matrix4x4& M, const Point3D& p)
+template<typename T>
+inline BasicPoint3D<T> operator *(const BasicMatrix4x4<T>& M, const BasicPoint3D<T>& p)
 {
-  return Point3D(p[0] * M[0][0] + p[1] * M[0][1] + p[2] * M[0][2] + M[0][3],
-                 p[0] * M[1][0] + p[1] * M[1][1] + p[2] * M[1][2] + M[1][3],
-                 p[0] * M[2][0] + p[1] * M[2][1] + p[2] * M[2][2] + M[2][3]);
+  return BasicPoint3D<T>(p[0] * M[0][0] + p[1] * M[0][1] + p[2] * M[0][2] + M[0][3],
+                         p[0] * M[1][0] + p[1] * M[1][1] + p[2] * M[1][2] + M[1][3],
+                         p[0] * M[2][0] + p[1] * M[2][1] + p[2] * M[2][2] + M[2][3]);
 }
 
-inline Vector3D transNorm(const Matrix4x4& M, const Vector3D& n)
+template<typename T>
+inline BasicVector3D<T> transNorm(const BasicMatrix4x4<T>& M, const BasicVector3D<T>& n)
 {
-  return Vector3D(n[0] * M[0][0] + n[1] * M[1][0] + n[2] * M[2][0],
-                  n[0] * M[0][1] + n[1] * M[1][1] + n[2] * M[2][1],
-                  n[0] * M[0][2] + n[1] * M[1][2] + n[2] * M[2][2]);
+  return BasicVector3D<T>(n[0] * M[0][0] + n[1] * M[1][0] + n[2] * M[2][0],
+                          n[0] * M[0][1] + n[1] * M[1][1] + n[2] * M[2][1],
+                          n[0] * M[0][2] + n[1] * M[1][2] + n[2] * M[2][2]);
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Matrix4x4& M)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicMatrix4x4<T>& M)
 {
   return os << "[" << M[0][0] << " " << M[0][1] << " " 
             << M[0][2] << " " << M[0][3] << "]" << std::endl
@@ -478,26 +494,145 @@ inline std::ostream& operator <<(std::ostream& os, const Matrix4x4& M)
             << M[3][2] << " " << M[3][3] << "]";
 }
 
-class Colour
+// An affine transform: the top three rows of a 4x4 matrix whose bottom row is always [0 0 0 1], a 3x3
+// linear part followed by a translation column. Every transform in a scene is one of these, and leaving
+// out the constant row makes composing two of them 36 multiplies instead of 64 and inverting one a 3x3
+// cofactor expansion instead of Gauss-Jordan elimination
+template<typename T>
+class BasicAffine3x4
 {
 public:
-  Colour(double r, double g, double b)
+  typedef T Scalar;
+
+  BasicAffine3x4()
+  {
+    // Construct the identity transform
+    std::fill(v_, v_+12, 0.0);
+    v_[0] = 1.0;
+    v_[5] = 1.0;
+    v_[10] = 1.0;
+  }
+  // The transform taking the x, y and z axes to x, y and z and the origin to t
+  BasicAffine3x4(const BasicVector3D<T>& x, const BasicVector3D<T>& y, const BasicVector3D<T>& z,
+                 const BasicVector3D<T>& t)
+  {
+    for(size_t r = 0; r < 3; ++r) {
+      v_[4*r] = x[r];
+      v_[4*r+1] = y[r];
+      v_[4*r+2] = z[r];
+      v_[4*r+3] = t[r];
+    }
+  }
+  // The top three rows of M, which is assumed to be affine
+  explicit BasicAffine3x4(const BasicMatrix4x4<T>& M)
+  {
+    std::copy(M.begin(), M.begin() + 12, v_);
+  }
+
+  const T *operator[](size_t row) const
+  {
+    return v_ + 4*row;
+  }
+  T *operator[](size_t row)
+  {
+    return v_ + 4*row;
+  }
+
+  BasicVector3D<T> translation() const
+  {
+    return BasicVector3D<T>(v_[3], v_[7], v_[11]);
+  }
+
+  BasicAffine3x4 invert() const;
+
+  // The same as the Matrix4x4 functions: the new transform is applied before this one
+  BasicAffine3x4 translate(T x, T y, T z) const;
+  BasicAffine3x4 translate(const BasicVector3D<T>& v) const;
+  BasicAffine3x4 rotate(T angle, T x, T y, T z) const;
+  BasicAffine3x4 rotate(T angle, const BasicVector3D<T>& v) const;
+  BasicAffine3x4 scale(T x, T y, T z) const;
+  BasicAffine3x4 scale(const BasicVector3D<T>& v) const;
+
+private:
+  T v_[12];
+};
+
+template<typename T>
+inline BasicAffine3x4<T> operator *(const BasicAffine3x4<T>& a, const BasicAffine3x4<T>& b)
+{
+  BasicAffine3x4<T> ret;
+
+  for(size_t i = 0; i < 3; ++i) {
+    const T* row = a[i];
+
+    for(size_t j = 0; j < 3; ++j) {
+      ret[i][j] = row[0] * b[0][j] + row[1] * b[1][j] + row[2] * b[2][j];
+    }
+    ret[i][3] = row[0] * b[0][3] + row[1] * b[1][3] + row[2] * b[2][3] + row[3];
+  }
+
+  return ret;
+}
+
+template<typename T>
+inline BasicVector3D<T> operator *(const BasicAffine3x4<T>& M, const BasicVector3D<T>& v)
+{
+  return BasicVector3D<T>(v[0] * M[0][0] + v[1] * M[0][1] + v[2] * M[0][2],
+                          v[0] * M[1][0] + v[1] * M[1][1] + v[2] * M[1][2],
+                          v[0] * M[2][0] + v[1] * M[2][1] + v[2] * M[2][2]);
+}
+
+template<typename T>
+inline BasicPoint3D<T> operator *(const BasicAffine3x4<T>& M, const BasicPoint3D<T>& p)
+{
+  return BasicPoint3D<T>(p[0] * M[0][0] + p[1] * M[0][1] + p[2] * M[0][2] + M[0][3],
+                         p[0] * M[1][0] + p[1] * M[1][1] + p[2] * M[1][2] + M[1][3],
+                         p[0] * M[2][0] + p[1] * M[2][1] + p[2] * M[2][2] + M[2][3]);
+}
+
+// Transforms a normal by the transpose of M, M being the inverse of the transform the surface went through
+template<typename T>
+inline BasicVector3D<T> transNorm(const BasicAffine3x4<T>& M, const BasicVector3D<T>& n)
+{
+  return BasicVector3D<T>(n[0] * M[0][0] + n[1] * M[1][0] + n[2] * M[2][0],
+                          n[0] * M[0][1] + n[1] * M[1][1] + n[2] * M[2][1],
+                          n[0] * M[0][2] + n[1] * M[1][2] + n[2] * M[2][2]);
+}
+
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicAffine3x4<T>& M)
+{
+  return os << "[" << M[0][0] << " " << M[0][1] << " " 
+            << M[0][2] << " " << M[0][3] << "]" << std::endl
+            << "[" << M[1][0] << " " << M[1][1] << " " 
+            << M[1][2] << " " << M[1][3] << "]" << std::endl
+            << "[" << M[2][0] << " " << M[2][1] << " " 
+            << M[2][2] << " " << M[2][3] << "]";
+}
+
+template<typename T>
+class BasicColour
+{
+public:
+  typedef T Scalar;
+
+  BasicColour(T r, T g, T b)
     : r_(r)
     , g_(g)
     , b_(b)
   {}
-  Colour(double c)
+  BasicColour(T c)
     : r_(c)
     , g_(c)
     , b_(c)
   {}
-  Colour(const Colour& other)
+  BasicColour(const BasicColour& other)
     : r_(other.r_)
     , g_(other.g_)
     , b_(other.b_)
   {}
 
-  Colour& operator =(const Colour& other)
+  BasicColour& operator =(const BasicColour& other)
   {
     r_ = other.r_;
     g_ = other.g_;
@@ -505,101 +640,274 @@ public:
     return *this;
   }
 
-  double R() const 
+  T R() const 
   { 
     return r_;
   }
-  double G() const 
+  T G() const 
   { 
     return g_;
   }
-  double B() const 
+  T B() const 
   { 
     return b_;
   }
 
 private:
-  double r_;
-  double g_;
-  double b_;
+  T r_;
+  T g_;
+  T b_;
 };
 
-inline Colour operator *(double s, const Colour& a)
+template<typename T>
+inline BasicColour<T> operator *(typename BasicColour<T>::Scalar s, const BasicColour<T>& a)
 {
-  return Colour(s*a.R(), s*a.G(), s*a.B());
+  return BasicColour<T>(s*a.R(), s*a.G(), s*a.B());
 }
 
-inline Colour operator *(const Colour& a, const Colour& b)
+template<typename T>
+inline BasicColour<T> operator *(const BasicColour<T>& a, const BasicColour<T>& b)
 {
-  return Colour(a.R()*b.R(), a.G()*b.G(), a.B()*b.B());
+  return BasicColour<T>(a.R()*b.R(), a.G()*b.G(), a.B()*b.B());
 }
 
-inline Colour operator +(const Colour& a, const Colour& b)
+template<typename T>
+inline BasicColour<T> operator +(const BasicColour<T>& a, const BasicColour<T>& b)
 {
-  return Colour(a.R()+b.R(), a.G()+b.G(), a.B()+b.B());
+  return BasicColour<T>(a.R()+b.R(), a.G()+b.G(), a.B()+b.B());
 }
 
-inline Colour clamp(const Colour& a, double min, double max)
+template<typename T>
+inline BasicColour<T> clamp(const BasicColour<T>& a, typename BasicColour<T>::Scalar min, typename BasicColour<T>::Scalar max)
 {
-  return Colour((a.R() < min) ? min : ((a.R() > max) ? max : a.R()),
-                (a.G() < min) ? min : ((a.G() > max) ? max : a.G()),
-                (a.B() < min) ? min : ((a.B() > max) ? max : a.B()));
+  return BasicColour<T>((a.R() < min) ? min : ((a.R() > max) ? max : a.R()),
+                        (a.G() < min) ? min : ((a.G() > max) ? max : a.G()),
+                        (a.B() < min) ? min : ((a.B() > max) ? max : a.B()));
 }
 
-inline std::ostream& operator <<(std::ostream& os, const Colour& c)
+template<typename T>
+inline std::ostream& operator <<(std::ostream& os, const BasicColour<T>& c)
 {
   return os << "c<" << c.R() << "," << c.G() << "," << c.B() << ">";
 }
 
-class Ray {
+// Rays and hit records are plain trivially copyable structs, so copying one is a handful of moves and never
+// renormalizes anything. Everything a traversal needs per ray is worked out once when the ray is made
+template<typename T>
+class BasicRay {
 public:
-  Ray(const Point3D& origin, const Vector3D& direction)
+  typedef T Scalar;
+
+  // The ray covers the points origin + t*direction for tmin <= t <= tmax. The direction is normalized
+  // so t is the distance from the origin
+  BasicRay(const BasicPoint3D<T>& origin, const BasicVector3D<T>& direction,
+           T tmin = 0.0, T tmax = std::numeric_limits<T>::infinity())
     : origin_(origin)
     , direction_(direction.normalized())
-  {}
-  Ray(const Ray& other)
-    : origin_(other.origin())
-    , direction_(other.direction().normalized())
-  {}
+    , tmin_(tmin)
+    , tmax_(tmax)
+  {
+    update_inverse();
+  }
 
-  Point3D origin() const
+  const BasicPoint3D<T>& origin() const
   {
     return origin_;
   }
-  Vector3D direction() const
+  const BasicVector3D<T>& direction() const
   {
     return direction_;
   }
+  // 1/direction per component, for slab tests against axis aligned boxes
+  const BasicVector3D<T>& inv_direction() const
+  {
+    return inv_direction_;
+  }
+  // 1 if the direction is negative along axis, 0 otherwise. Picks which side of a box the ray enters
+  // through without comparing, and which child of a BVH node is nearer
+  unsigned int sign(int axis) const
+  {
+    return sign_[axis];
+  }
+  T tmin() const
+  {
+    return tmin_;
+  }
+  T tmax() const
+  {
+    return tmax_;
+  }
+
+  // The same ray in the coordinate system M transforms to. The direction isn't renormalized so a
+  // value of t refers to the same point on the ray in both coordinate systems
+  BasicRay transform(const BasicAffine3x4<T>& M) const
+  {
+    BasicRay r(*this);
+    r.origin_ = M * origin_;
+    r.direction_ = M * direction_;
+    r.update_inverse();
+    return r;
+  }
+
+  // transform() for a matrix that only translates by v
+  BasicRay translate(const BasicVector3D<T>& v) const
+  {
+    BasicRay r(*this);
+    r.origin_ = origin_ + v;
+    return r;
+  }
 
 private:
-  Point3D origin_;
-  Vector3D direction_;
+  BasicPoint3D<T> origin_;
+  BasicVector3D<T> direction_;
+  BasicVector3D<T> inv_direction_;
+  unsigned int sign_[3];
+  T tmin_;
+  T tmax_;
+
+  void update_inverse()
+  {
+    for(int k = 0; k < 3; k++)
+    {
+      inv_direction_[k] = 1.0 / direction_[k];
+      sign_[k] = (inv_direction_[k] < 0.0) ? 1 : 0;
+    }
+  }
 };
 
-class Intersection {
-public:
-  Intersection() 
-    : q(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity())
-    , n(0.0, 0.0, 0.0)
-    , m(NULL)
-    //, t(std::numeric_limits<double>::infinity())
+// What the closest hit search keeps track of: how far along the ray the hit is and which part of which
+// instance was hit. The point, normal and material only matter for the hit that ends up closest, so
+// they're worked out from this afterwards by SceneBVH::get_surface()
+template<typename T>
+struct BasicIntersection {
+  typedef T Scalar;
+
+  BasicIntersection()
+    : t(std::numeric_limits<T>::infinity())
+    , primitive(0)
+    , u(0.0)
+    , v(0.0)
+    , instance(0)
   {}
-  Intersection(const Point3D q, const Vector3D n, const Material* m)
-    : q(q)
-    , n(n)
-    , m(m)
+
+  // Ray parameter of the hit: t*ray.direction + ray.origin. Primitives only report hits closer than this,
+  // so while searching for the closest hit it holds the closest one found so far
+  T t;
+  unsigned int primitive; // Which part of the primitive was hit, e.g. the triangle of a mesh or the face of a box
+  T u, v; // Barycentric coordinates of the hit on a triangle
+  unsigned int instance; // Index of the instance that was hit in the scene's SceneBVH
+};
+
+// Everything is templated on the scalar type but the renderer itself works in double precision
+typedef BasicPoint2D<double> Point2D;
+typedef BasicPoint3D<double> Point3D;
+typedef BasicVector3D<double> Vector3D;
+typedef BasicVector4D<double> Vector4D;
+typedef BasicMatrix4x4<double> Matrix4x4;
+typedef BasicAffine3x4<double> Affine3x4;
+typedef BasicColour<double> Colour;
+typedef BasicRay<double> Ray;
+typedef BasicIntersection<double> Intersection;
+
+// Precision mesh geometry is stored in. Building with -DCS488_FLOAT_GEOMETRY stores it in single precision,
+// halving the memory meshes take. Intersection tests always do their arithmetic in double
+#ifdef CS488_FLOAT_GEOMETRY
+typedef float GeomReal;
+#else
+typedef double GeomReal;
+#endif
+typedef BasicPoint3D<GeomReal> GeomPoint3D;
+typedef BasicVector3D<GeomReal> GeomVector3D;
+
+class BoundingBox {
+public:
+  // An empty box. Extending it with anything results in that thing's bounds
+  BoundingBox()
+    : min_(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity())
+    , max_(-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity())
   {}
-  Intersection(const Intersection& other)
-    : q(other.q)
-    , n(other.n.normalized())
-    , m(other.m)
-    //, t(other.t)
+  BoundingBox(const Point3D& min, const Point3D& max)
+    : min_(min)
+    , max_(max)
   {}
 
-  Point3D q; // Intersection point
-  Vector3D n; // Surface normal at intersection point
-  const Material *m; // Material properties at intersection point
-  //double t; // Distance from ray's origin along ray's direction vector to intersection point: t*ray.direction + ray.origin
+  const Point3D& min() const
+  {
+    return min_;
+  }
+  const Point3D& max() const
+  {
+    return max_;
+  }
+
+  bool empty() const
+  {
+    return min_[0] > max_[0] || min_[1] > max_[1] || min_[2] > max_[2];
+  }
+
+  void extend(const Point3D& p)
+  {
+    for(int k = 0; k < 3; k++)
+    {
+      min_[k] = std::min(min_[k], p[k]);
+      max_[k] = std::max(max_[k], p[k]);
+    }
+  }
+  void extend(const BoundingBox& other)
+  {
+    for(int k = 0; k < 3; k++)
+    {
+      min_[k] = std::min(min_[k], other.min_[k]);
+      max_[k] = std::max(max_[k], other.max_[k]);
+    }
+  }
+
+  Point3D centroid() const
+  {
+    return Point3D(0.5*(min_[0]+max_[0]), 0.5*(min_[1]+max_[1]), 0.5*(min_[2]+max_[2]));
+  }
+
+  double area() const
+  {
+    if(empty()) return 0.0;
+    Vector3D e = max_ - min_;
+    return 2.0*(e[0]*e[1] + e[1]*e[2] + e[2]*e[0]);
+  }
+
+  // The box containing all eight corners of this box after transforming them by M
+  BoundingBox transform(const Affine3x4& M) const
+  {
+    BoundingBox b;
+    if(empty()) return b;
+    for(int c = 0; c < 8; c++)
+    {
+      b.extend(M * Point3D((c & 1) ? max_[0] : min_[0], (c & 2) ? max_[1] : min_[1], (c & 4) ? max_[2] : min_[2]));
+    }
+    return b;
+  }
+
+  // Slab test. On a hit tnear is set to the parameter where the ray enters the box (clamped to ray.tmin())
+  bool intersect(const Ray& ray, double tmax, double& tnear) const
+  {
+    const Point3D& o = ray.origin();
+    const Vector3D& inv_dir = ray.inv_direction();
+    double t0 = ray.tmin(), t1 = std::min(tmax, ray.tmax());
+    for(int k = 0; k < 3; k++)
+    {
+      // Rays heading in the negative direction enter through the max side
+      double tn = ((ray.sign(k) ? max_[k] : min_[k]) - o[k]) * inv_dir[k];
+      double tf = ((ray.sign(k) ? min_[k] : max_[k]) - o[k]) * inv_dir[k];
+      t0 = (tn > t0) ? tn : t0;
+      t1 = (tf < t1) ? tf : t1;
+      if(t0 > t1) return false;
+    }
+    tnear = t0;
+    return true;
+  }
+
+private:
+  Point3D min_;
+  Point3D max_;
 };
 
 #endif // CS488_ALGEBRA_HPP
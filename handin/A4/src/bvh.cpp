@@ -0,0 +1,731 @@
+#include "bvh.hpp"
+#include "cachefile.hpp"
+#include "mappedfile.hpp"
+#include "threadpool.hpp"
+#include <algorithm>
+#include <limits>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+
+// Relative costs of visiting a node and of testing an object for the surface area heuristic
+static const double TRAVERSAL_COST = 1.0;
+static const double INTERSECT_COST = 2.0;
+
+// Leaves never hold more than this many objects, even if the heuristic would rather not split
+static const size_t MAX_LEAF_SIZE = 4;
+
+// Past this depth nodes are split at the median so the traversal stack in intersect() can't overflow
+static const int MAX_SAH_DEPTH = 32;
+
+// Most bins the centroids are sorted into along each axis. Splits can only go between bins, so more bins find
+// better splits but take longer to sweep. Ranges with fewer objects than this get one bin per object
+static const int BIN_COUNT = 32;
+
+// Ranges of at least this many objects are binned and partitioned in parallel and their two halves built as
+// separate tasks. Smaller ones are built start to finish by whichever thread gets to them
+static const size_t PARALLEL_MIN_OBJECTS = 32768;
+
+// Number of objects each task bins or partitions when a range is split in parallel
+static const size_t PARALLEL_CHUNK = 8192;
+
+// Trees over fewer objects than this are quicker to build than to load from the cache
+static const size_t CACHE_MIN_OBJECTS = 4096;
+
+static const char BVH_FILE_MAGIC[8] = {'C', 'S', '4', '8', '8', 'B', 'V', 'H'};
+// Bumped whenever the layout of a node or the way trees are built changes
+static const unsigned int BVH_FILE_VERSION = 3;
+
+static bool s_wide_bvh = true;
+
+// An object's box and its index in the array build() was given. The box is carried along with the index so
+// the build reads boxes in order instead of looking each one up
+struct BuildObject {
+  BoundingBox bounds;
+  unsigned int index;
+};
+
+// What every step of a build works on. The objects in a node's range are reordered in place so each child's
+// objects end up in one half of it
+struct BuildData {
+  std::vector<BuildObject> objects;
+  ThreadPool* pool; // NULL to build everything on the calling thread
+};
+
+// The boxes around the objects whose centroids fall in each bin along each axis, and how many there are. Only
+// the first size bins are used
+struct Bins {
+  // Empties the bins, ready to sort objects into n of them. The same bins are reused from node to node, since
+  // clearing all of them costs more than binning the handful of objects near the leaves
+  void reset(int n)
+  {
+    size = n;
+    for(int axis = 0; axis < 3; axis++)
+    {
+      for(int k = 0; k < size; k++)
+      {
+        bounds[axis][k] = BoundingBox();
+        count[axis][k] = 0;
+      }
+    }
+  }
+
+  void add(const Bins& other)
+  {
+    for(int axis = 0; axis < 3; axis++)
+    {
+      for(int k = 0; k < size; k++)
+      {
+        bounds[axis][k].extend(other.bounds[axis][k]);
+        count[axis][k] += other.count[axis][k];
+      }
+    }
+  }
+
+  int size;
+  BoundingBox bounds[3][BIN_COUNT];
+  size_t count[3][BIN_COUNT];
+};
+
+// Objects whose centroids fall in bins below bin along axis go in the first child, the rest in the second.
+// bin is -1 for a split at the median
+struct Split {
+  int axis;
+  int bin;
+  double cost;
+};
+
+// The part of a tree one task built. Big ranges are split into two subtrees built in parallel, anything smaller
+// is built straight into nodes in the layout BVH uses, with second child offsets relative to the start of nodes
+struct Subtree {
+  BoundingBox bounds;
+  int axis;
+  std::unique_ptr<Subtree> children[2];
+  std::vector<BVH::Node> nodes;
+};
+
+// Number of bins a range of count objects is split into
+static int bin_count(size_t count)
+{
+  return static_cast<int>(std::min<size_t>(count, BIN_COUNT));
+}
+
+// Bin a centroid with coordinate x falls in along an axis whose centroids start at min, where scale is the number
+// of bins per unit length
+static inline int bin_index(double x, double min, double scale, int bins)
+{
+  int k = static_cast<int>((x - min) * scale);
+  return std::min(std::max(k, 0), bins - 1);
+}
+
+static double bin_scale(const BoundingBox& cbox, int axis, int bins)
+{
+  double extent = cbox.max()[axis] - cbox.min()[axis];
+  return (extent > 0.0) ? bins / extent : 0.0;
+}
+
+static size_t chunk_count(size_t begin, size_t end)
+{
+  return (end - begin + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+}
+
+// Calls f(chunk begin, chunk end, chunk) for [begin, end) cut into PARALLEL_CHUNK sized chunks, spread over the pool
+template<typename F>
+static void for_each_chunk(ThreadPool& pool, size_t begin, size_t end, F f)
+{
+  pool.parallel_for(chunk_count(begin, end), [&](size_t c) {
+    f(begin + c*PARALLEL_CHUNK, std::min(end, begin + (c + 1)*PARALLEL_CHUNK), c);
+  });
+}
+
+// Bounds of the objects in [begin, end) and of their centroids
+static void range_bounds(const BuildData& data, size_t begin, size_t end, BoundingBox& box, BoundingBox& cbox)
+{
+  for(size_t i = begin; i < end; i++)
+  {
+    box.extend(data.objects[i].bounds);
+    cbox.extend(data.objects[i].bounds.centroid());
+  }
+}
+
+static void bin_range(const BuildData& data, size_t begin, size_t end, const BoundingBox& cbox, Bins& bins)
+{
+  double scale[3] = {bin_scale(cbox, 0, bins.size), bin_scale(cbox, 1, bins.size), bin_scale(cbox, 2, bins.size)};
+  for(size_t i = begin; i < end; i++)
+  {
+    const BoundingBox& b = data.objects[i].bounds;
+    Point3D c = b.centroid();
+    for(int axis = 0; axis < 3; axis++)
+    {
+      // Every centroid is in the same place along an axis with no extent, so it has nothing to split
+      if(scale[axis] == 0.0) continue;
+      int k = bin_index(c[axis], cbox.min()[axis], scale[axis], bins.size);
+      bins.bounds[axis][k].extend(b);
+      bins.count[axis][k]++;
+    }
+  }
+}
+
+// The cheapest split between bins by the surface area heuristic, axis -1 if there is nothing to split
+static Split find_split(const Bins& bins, const BoundingBox& box)
+{
+  Split best = {-1, -1, std::numeric_limits<double>::infinity()};
+  double inv_area = (box.area() > 0.0) ? 1.0 / box.area() : 0.0;
+
+  for(int axis = 0; axis < 3; axis++)
+  {
+    // right_area[k] and right_count[k] are for the objects in bins k..bins.size-1
+    double right_area[BIN_COUNT];
+    size_t right_count[BIN_COUNT];
+    BoundingBox right;
+    size_t n = 0;
+    for(int k = bins.size - 1; k > 0; k--)
+    {
+      right.extend(bins.bounds[axis][k]);
+      n += bins.count[axis][k];
+      right_area[k] = right.area();
+      right_count[k] = n;
+    }
+
+    BoundingBox left;
+    n = 0;
+    for(int k = 1; k < bins.size; k++)
+    {
+      left.extend(bins.bounds[axis][k - 1]);
+      n += bins.count[axis][k - 1];
+      if(n == 0 || right_count[k] == 0) continue;
+
+      double cost = TRAVERSAL_COST + INTERSECT_COST * inv_area * (left.area() * n + right_area[k] * right_count[k]);
+      if(cost < best.cost)
+      {
+        best.axis = axis;
+        best.bin = k;
+        best.cost = cost;
+      }
+    }
+  }
+
+  return best;
+}
+
+// Works out the bounds of [begin, end) and how to split it, binning in parallel if asked to and into bins if not.
+// Returns false if the range should be a leaf instead
+static bool plan_node(const BuildData& data, size_t begin, size_t end, int depth, bool parallel, Bins& bins,
+                      BoundingBox& box, BoundingBox& cbox, Split& split)
+{
+  size_t count = end - begin;
+
+  if(parallel)
+  {
+    // Each chunk gets its own boxes and they are merged in order afterwards, so the result doesn't depend on
+    // which threads got to which chunks
+    std::vector<BoundingBox> boxes(chunk_count(begin, end)), cboxes(boxes.size());
+    for_each_chunk(*data.pool, begin, end, [&](size_t b, size_t e, size_t c) { range_bounds(data, b, e, boxes[c], cboxes[c]); });
+    for(size_t c = 0; c < boxes.size(); c++)
+    {
+      box.extend(boxes[c]);
+      cbox.extend(cboxes[c]);
+    }
+  }
+  else
+  {
+    range_bounds(data, begin, end, box, cbox);
+  }
+
+  split.axis = -1;
+  split.bin = -1;
+  split.cost = std::numeric_limits<double>::infinity();
+  if(count > 1 && depth < MAX_SAH_DEPTH)
+  {
+    bins.reset(bin_count(count));
+    if(parallel)
+    {
+      std::vector<Bins> chunk_bins(chunk_count(begin, end));
+      for_each_chunk(*data.pool, begin, end, [&](size_t b, size_t e, size_t c) {
+        chunk_bins[c].reset(bins.size);
+        bin_range(data, b, e, cbox, chunk_bins[c]);
+      });
+      for(const Bins& b : chunk_bins) bins.add(b);
+    }
+    else
+    {
+      bin_range(data, begin, end, cbox, bins);
+    }
+    split = find_split(bins, box);
+  }
+
+  if(count == 1 || (count <= MAX_LEAF_SIZE && split.cost >= INTERSECT_COST * count)) return false;
+
+  // Either splitting is cheaper or there are too many objects for a leaf. If no split was found, because the
+  // centroids all coincide or the tree is too deep, split at the median along the longest axis of the centroids
+  if(split.axis < 0)
+  {
+    Vector3D extent = cbox.max() - cbox.min();
+    split.axis = (extent[0] > extent[1] && extent[0] > extent[2]) ? 0 : ((extent[1] > extent[2]) ? 1 : 2);
+    split.bin = -1;
+  }
+  return true;
+}
+
+// Reorders [begin, end) so the first child's objects come first and returns where the second child's start
+static size_t partition(BuildData& data, size_t begin, size_t end, const Split& split, const BoundingBox& cbox,
+                        bool parallel)
+{
+  int axis = split.axis;
+  if(split.bin < 0)
+  {
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(data.objects.begin() + begin, data.objects.begin() + mid, data.objects.begin() + end,
+                     [&](const BuildObject& a, const BuildObject& b) {
+                       return a.bounds.centroid()[axis] < b.bounds.centroid()[axis];
+                     });
+    return mid;
+  }
+
+  int bins = bin_count(end - begin);
+  double min = cbox.min()[axis], scale = bin_scale(cbox, axis, bins);
+  auto left = [&](const BuildObject& o) { return bin_index(o.bounds.centroid()[axis], min, scale, bins) < split.bin; };
+
+  if(!parallel)
+  {
+    return std::partition(data.objects.begin() + begin, data.objects.begin() + end, left) - data.objects.begin();
+  }
+
+  // Count each chunk's objects on either side, work out where each chunk's share of both sides goes and copy
+  // them there, then copy the lot back
+  size_t chunks = chunk_count(begin, end);
+  std::vector<size_t> left_count(chunks);
+  for_each_chunk(*data.pool, begin, end, [&](size_t b, size_t e, size_t c) {
+    left_count[c] = std::count_if(data.objects.begin() + b, data.objects.begin() + e, left);
+  });
+
+  size_t mid = begin;
+  for(size_t c = 0; c < chunks; c++) mid += left_count[c];
+
+  std::vector<size_t> left_start(chunks), right_start(chunks);
+  size_t l = 0, r = mid - begin;
+  for(size_t c = 0; c < chunks; c++)
+  {
+    left_start[c] = l;
+    right_start[c] = r;
+    l += left_count[c];
+    r += std::min(end, begin + (c + 1)*PARALLEL_CHUNK) - (begin + c*PARALLEL_CHUNK) - left_count[c];
+  }
+
+  std::vector<BuildObject> sorted(end - begin);
+  for_each_chunk(*data.pool, begin, end, [&](size_t b, size_t e, size_t c) {
+    size_t to_left = left_start[c], to_right = right_start[c];
+    for(size_t i = b; i < e; i++)
+    {
+      const BuildObject& o = data.objects[i];
+      sorted[left(o) ? to_left++ : to_right++] = o;
+    }
+  });
+  for_each_chunk(*data.pool, begin, end, [&](size_t b, size_t e, size_t) {
+    std::copy(sorted.begin() + (b - begin), sorted.begin() + (e - begin), data.objects.begin() + b);
+  });
+
+  return mid;
+}
+
+// Builds the tree over [begin, end) on the calling thread, appending it to nodes
+static unsigned int build_serial(BuildData& data, Bins& bins, std::vector<BVH::Node>& nodes, size_t begin, size_t end,
+                                 int depth)
+{
+  unsigned int index = nodes.size();
+  nodes.push_back(BVH::Node());
+
+  BoundingBox box, cbox;
+  Split split;
+  if(!plan_node(data, begin, end, depth, false, bins, box, cbox, split))
+  {
+    nodes[index].bounds = box;
+    nodes[index].offset = begin;
+    nodes[index].count = end - begin;
+    nodes[index].axis = 0;
+    return index;
+  }
+
+  size_t mid = partition(data, begin, end, split, cbox, false);
+  build_serial(data, bins, nodes, begin, mid, depth + 1);
+  unsigned int second = build_serial(data, bins, nodes, mid, end, depth + 1);
+
+  nodes[index].bounds = box;
+  nodes[index].offset = second;
+  nodes[index].count = 0;
+  nodes[index].axis = split.axis;
+  return index;
+}
+
+// Builds the tree over [begin, end) into tree, splitting big ranges in parallel and building both halves as
+// separate tasks
+static void build_parallel(BuildData& data, Subtree& tree, size_t begin, size_t end, int depth)
+{
+  if(!data.pool || end - begin < PARALLEL_MIN_OBJECTS)
+  {
+    std::unique_ptr<Bins> bins(new Bins());
+    tree.nodes.reserve(2*(end - begin));
+    build_serial(data, *bins, tree.nodes, begin, end, depth);
+    return;
+  }
+
+  // Ranges this big always get split, they are never leaves
+  std::unique_ptr<Bins> bins(new Bins());
+  BoundingBox box, cbox;
+  Split split;
+  plan_node(data, begin, end, depth, true, *bins, box, cbox, split);
+  size_t mid = partition(data, begin, end, split, cbox, true);
+
+  tree.bounds = box;
+  tree.axis = split.axis;
+  tree.children[0].reset(new Subtree());
+  tree.children[1].reset(new Subtree());
+  data.pool->parallel_for(2, [&](size_t k) {
+    if(k == 0) build_parallel(data, *tree.children[0], begin, mid, depth + 1);
+    else build_parallel(data, *tree.children[1], mid, end, depth + 1);
+  });
+}
+
+// Appends tree to nodes in depth first order, moving the offsets in subtrees that were built on their own
+static void flatten(const Subtree& tree, std::vector<BVH::Node>& nodes)
+{
+  if(!tree.children[0])
+  {
+    unsigned int base = nodes.size();
+    for(BVH::Node node : tree.nodes)
+    {
+      if(node.count == 0) node.offset += base;
+      nodes.push_back(node);
+    }
+    return;
+  }
+
+  unsigned int index = nodes.size();
+  nodes.push_back(BVH::Node());
+  flatten(*tree.children[0], nodes);
+
+  nodes[index].bounds = tree.bounds;
+  nodes[index].offset = nodes.size();
+  nodes[index].count = 0;
+  nodes[index].axis = tree.axis;
+  flatten(*tree.children[1], nodes);
+}
+
+// Rounds x to a float no greater than it
+static float round_down(double x)
+{
+  float f = static_cast<float>(x);
+  return (f > x) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+// Rounds x to a float no less than it
+static float round_up(double x)
+{
+  float f = static_cast<float>(x);
+  return (f < x) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Collapses the binary subtree at index into wide nodes appended to wide, returning the index of the one at the
+// top. Its children start out as the binary node's two, then whichever interior child has the biggest surface
+// area, and so is the likeliest to be visited, is replaced by its own two children until there are WIDTH of them
+// or they are all leaves. A binary tree that is just a leaf becomes a wide node with one child
+static unsigned int collapse_node(const MappedArray<BVH::Node>& nodes, unsigned int index,
+                                  std::vector<BVH::WideNode, AlignedAllocator<BVH::WideNode> >& wide)
+{
+  unsigned int children[BVH::WIDTH];
+  unsigned int size = 0;
+  if(nodes[index].count > 0)
+  {
+    children[size++] = index;
+  }
+  else
+  {
+    children[size++] = index + 1;
+    children[size++] = nodes[index].offset;
+  }
+
+  while(size < BVH::WIDTH)
+  {
+    int best = -1;
+    double best_area = -1.0;
+    for(unsigned int c = 0; c < size; c++)
+    {
+      const BVH::Node& child = nodes[children[c]];
+      if(child.count == 0 && child.bounds.area() > best_area)
+      {
+        best = c;
+        best_area = child.bounds.area();
+      }
+    }
+    if(best < 0) break;
+
+    unsigned int opened = children[best];
+    children[best] = opened + 1;
+    children[size++] = nodes[opened].offset;
+  }
+
+  unsigned int w = wide.size();
+  wide.push_back(BVH::WideNode());
+  for(int c = 0; c < BVH::WIDTH; c++)
+  {
+    for(int a = 0; a < 3; a++)
+    {
+      wide[w].bounds[a][c] = std::numeric_limits<float>::infinity();
+      wide[w].bounds[a + 3][c] = -std::numeric_limits<float>::infinity();
+    }
+    wide[w].offset[c] = 0;
+    wide[w].count[c] = 0;
+  }
+  wide[w].size = size;
+
+  for(unsigned int c = 0; c < size; c++)
+  {
+    const BVH::Node& child = nodes[children[c]];
+    for(int a = 0; a < 3; a++)
+    {
+      wide[w].bounds[a][c] = round_down(child.bounds.min()[a]);
+      wide[w].bounds[a + 3][c] = round_up(child.bounds.max()[a]);
+    }
+
+    // wide grows as the children are collapsed, so it is indexed afresh every time
+    unsigned int offset = (child.count > 0) ? child.offset : collapse_node(nodes, children[c], wide);
+    wide[w].offset[c] = offset;
+    wide[w].count[c] = child.count;
+  }
+
+  return w;
+}
+
+// The box around all of a wide node's children
+static BoundingBox wide_node_bounds(const BVH::WideNode& node)
+{
+  BoundingBox box;
+  for(unsigned int c = 0; c < node.size; c++) box.extend(node.child_bounds(c));
+  return box;
+}
+
+BVH::BVH()
+  : m_build_seconds(0.0)
+{
+}
+
+void BVH::collapse()
+{
+  std::vector<WideNode, AlignedAllocator<WideNode> > wide;
+  wide.reserve(m_nodes.size() / 2 + 1);
+  collapse_node(m_nodes, 0, wide);
+
+  m_wide = MappedArray<WideNode, AlignedAllocator<WideNode> >(std::move(wide));
+  m_nodes = MappedArray<Node>();
+  m_bounds = wide_node_bounds(m_wide[0]);
+}
+
+void BVH::build(const std::vector<BoundingBox>& bounds)
+{
+  m_nodes = MappedArray<Node>();
+  m_wide = MappedArray<WideNode, AlignedAllocator<WideNode> >();
+  m_indices = MappedArray<unsigned int>();
+  m_file.reset();
+  m_bounds = BoundingBox();
+  m_build_seconds = 0.0;
+  if(bounds.empty()) return;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  // Whether the pool is used only depends on the number of objects, so the same boxes always give the same tree
+  BuildData data;
+  data.pool = (bounds.size() >= PARALLEL_MIN_OBJECTS) ? &render_pool() : NULL;
+  data.objects.resize(bounds.size());
+  for(size_t i = 0; i < bounds.size(); i++)
+  {
+    data.objects[i].bounds = bounds[i];
+    data.objects[i].index = i;
+  }
+
+  Subtree tree;
+  build_parallel(data, tree, 0, bounds.size(), 0);
+
+  std::vector<Node> nodes;
+  if(tree.children[0])
+  {
+    nodes.reserve(2*bounds.size());
+    flatten(tree, nodes);
+  }
+  else
+  {
+    nodes.swap(tree.nodes);
+  }
+
+  std::vector<unsigned int> indices(bounds.size());
+  for(size_t i = 0; i < indices.size(); i++) indices[i] = data.objects[i].index;
+
+  m_nodes = MappedArray<Node>(std::move(nodes));
+  m_indices = MappedArray<unsigned int>(std::move(indices));
+  m_bounds = m_nodes[0].bounds;
+  if(s_wide_bvh) collapse();
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  m_build_seconds = elapsed.count();
+}
+
+void BVH::build_cached(const std::vector<BoundingBox>& bounds)
+{
+  std::string path;
+  unsigned long long key = 0;
+  if(bounds.size() >= CACHE_MIN_OBJECTS && !cache_dir().empty())
+  {
+    // Trees in either layout can be cached side by side
+    key = fnv1a(bounds.data(), bounds.size() * sizeof(BoundingBox));
+    key = fnv1a(&s_wide_bvh, sizeof(s_wide_bvh), key);
+    path = cache_path(key, ".bvh");
+
+    // Anything wrong with the cached tree just means building it again
+    std::vector<CacheSection> sections = {
+      {NULL, sizeof(Node), 0}, {NULL, sizeof(WideNode), 0}, {NULL, sizeof(unsigned int), 0}
+    };
+    std::string ignored;
+    std::shared_ptr<const MappedFile> file = read_cache_file(path, BVH_FILE_MAGIC, BVH_FILE_VERSION, key, sections, ignored);
+    if(file && assign(MappedArray<Node>(static_cast<const Node*>(sections[0].data), sections[0].count),
+                      MappedArray<WideNode, AlignedAllocator<WideNode> >(static_cast<const WideNode*>(sections[1].data),
+                                                                         sections[1].count),
+                      MappedArray<unsigned int>(static_cast<const unsigned int*>(sections[2].data), sections[2].count),
+                      bounds.size()))
+    {
+      m_file = file;
+      return;
+    }
+  }
+
+  build(bounds);
+
+  if(!path.empty())
+  {
+    std::vector<CacheSection> sections = {
+      {m_nodes.data(), sizeof(Node), m_nodes.size()},
+      {m_wide.data(), sizeof(WideNode), m_wide.size()},
+      {m_indices.data(), sizeof(unsigned int), m_indices.size()}
+    };
+    std::string error;
+    if(!write_cache_file(path, BVH_FILE_MAGIC, BVH_FILE_VERSION, key, sections, error))
+    {
+      std::cerr << "Couldn't cache BVH: " << error << std::endl;
+    }
+  }
+}
+
+bool BVH::assign(MappedArray<Node>&& nodes, MappedArray<WideNode, AlignedAllocator<WideNode> >&& wide_nodes,
+                 MappedArray<unsigned int>&& indices, size_t objects)
+{
+  // Check every link so a damaged file can't send a traversal off the end of an array or round in circles.
+  // A node's children always come after it, in the binary layout the first one straight after
+  bool valid = indices.size() == objects && (nodes.empty() || wide_nodes.empty())
+               && (nodes.empty() && wide_nodes.empty()) == (objects == 0);
+  for(size_t i = 0; valid && i < indices.size(); i++) valid = indices[i] < objects;
+  for(size_t i = 0; valid && i < nodes.size(); i++)
+  {
+    const Node& node = nodes[i];
+    valid = (node.count > 0) ? node.offset + (size_t)node.count <= indices.size()
+                             : i + 1 < node.offset && node.offset < nodes.size() && node.axis < 3;
+  }
+  for(size_t i = 0; valid && i < wide_nodes.size(); i++)
+  {
+    const WideNode& node = wide_nodes[i];
+    valid = node.size >= 1 && node.size <= WIDTH;
+    for(unsigned int c = 0; valid && c < node.size; c++)
+    {
+      valid = (node.count[c] > 0) ? node.offset[c] + (size_t)node.count[c] <= indices.size()
+                                  : i < node.offset[c] && node.offset[c] < wide_nodes.size();
+    }
+  }
+
+  m_file.reset();
+  m_build_seconds = 0.0;
+  if(!valid)
+  {
+    m_nodes = MappedArray<Node>();
+    m_wide = MappedArray<WideNode, AlignedAllocator<WideNode> >();
+    m_indices = MappedArray<unsigned int>();
+    m_bounds = BoundingBox();
+    return false;
+  }
+
+  m_nodes = std::move(nodes);
+  m_wide = std::move(wide_nodes);
+  m_indices = std::move(indices);
+  if(!m_wide.empty()) m_bounds = wide_node_bounds(m_wide[0]);
+  else if(!m_nodes.empty()) m_bounds = m_nodes[0].bounds;
+  else m_bounds = BoundingBox();
+  return true;
+}
+
+BVH::Stats BVH::stats() const
+{
+  Stats stats = {0, 0, 0, 0, m_wide.empty() ? 2 : WIDTH, 0, 0.0, m_build_seconds};
+  if(empty()) return stats;
+
+  // The chance of a ray that hits the root hitting a node is the ratio of their surface areas
+  double root_area = m_bounds.area();
+  auto probability = [&](const BoundingBox& box) { return (root_area > 0.0) ? box.area() / root_area : 1.0; };
+  auto add_leaf = [&](size_t count, int depth, double p) {
+    stats.leaves++;
+    stats.objects += count;
+    stats.max_leaf_size = std::max(stats.max_leaf_size, count);
+    stats.depth = std::max(stats.depth, depth);
+    stats.sah_cost += INTERSECT_COST * count * p;
+  };
+
+  std::vector< std::pair<unsigned int, int> > stack(1, std::make_pair(0u, 0)); // Nodes and their depths
+  while(!stack.empty())
+  {
+    unsigned int index = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
+    stats.nodes++;
+
+    if(!m_wide.empty())
+    {
+      // Leaves are children of the wide nodes rather than nodes of their own
+      const WideNode& node = m_wide[index];
+      stats.sah_cost += TRAVERSAL_COST * probability(wide_node_bounds(node));
+      for(unsigned int c = 0; c < node.size; c++)
+      {
+        if(node.count[c] > 0) add_leaf(node.count[c], depth + 1, probability(node.child_bounds(c)));
+        else stack.push_back(std::make_pair(node.offset[c], depth + 1));
+      }
+      continue;
+    }
+
+    const Node& node = m_nodes[index];
+    if(node.count > 0)
+    {
+      add_leaf(node.count, depth, probability(node.bounds));
+      continue;
+    }
+
+    stats.sah_cost += TRAVERSAL_COST * probability(node.bounds);
+    stack.push_back(std::make_pair(index + 1, depth + 1));
+    stack.push_back(std::make_pair(node.offset, depth + 1));
+  }
+
+  return stats;
+}
+
+std::ostream& operator<<(std::ostream& out, const BVH::Stats& stats)
+{
+  out << stats.nodes << " " << stats.width << "-wide nodes, " << stats.leaves << " leaves of "
+      << (stats.leaves > 0 ? (double)stats.objects / stats.leaves : 0.0) << " objects on average and "
+      << stats.max_leaf_size << " at most, depth " << stats.depth << ", SAH cost " << stats.sah_cost;
+  if(stats.build_seconds > 0.0) out << ", built in " << stats.build_seconds << "s";
+  else out << ", loaded from the cache";
+  return out;
+}
+
+void set_wide_bvh(bool wide)
+{
+  s_wide_bvh = wide;
+}
+
+bool wide_bvh()
+{
+  return s_wide_bvh;
+}
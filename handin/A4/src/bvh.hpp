@@ -0,0 +1,425 @@
+#ifndef CS488_BVH_HPP
+#define CS488_BVH_HPP
+
+#include <vector>
+#include <memory>
+#include <iosfwd>
+#include "algebra.hpp"
+#include "packet.hpp"
+#include "mappedarray.hpp"
+
+class MappedFile;
+
+// A bounding volume hierarchy over a set of boxes, built top down using the surface area heuristic.
+// The BVH doesn't know what it is bounding, it just hands back indices into whatever array of
+// objects the boxes given to build() came from.
+// Splits are picked by sorting the objects' centroids into bins rather than sorting the objects, and
+// big trees are built on the render pool: the top levels are binned and partitioned in parallel and
+// the subtrees below them are built as separate tasks. The binary tree that comes out is then collapsed
+// into a wide one, see WideNode.
+class BVH {
+public:
+  struct Node {
+    BoundingBox bounds;
+    unsigned int offset; // Leaves: first entry in m_indices. Interior nodes: index of the second child (the first child is the next node)
+    unsigned short count; // Number of objects in a leaf, 0 for interior nodes
+    unsigned short axis; // Axis interior nodes were split along, used to visit the nearest child first
+  };
+
+  // Most children a node of the wide layout has. Four children's planes fill a DVec with AVX
+  static const int WIDTH = 4;
+
+  // A node of the wide layout. Each one stands in for up to three levels of binary nodes, and its children's
+  // boxes are stored a plane at a time so one slab test covers all of them. The boxes are rounded outwards to
+  // float so a node is two cache lines
+  struct alignas(64) WideNode {
+    float bounds[6][WIDTH]; // Min x, y and z then max x, y and z of each child. Unused slots hold empty boxes
+    unsigned int offset[WIDTH]; // Leaf children: first entry in m_indices. Interior children: index of their node
+    unsigned short count[WIDTH]; // Number of objects in a leaf child, 0 for interior children
+    unsigned int size; // Number of children, which are in the first size slots
+
+    BoundingBox child_bounds(int c) const
+    {
+      return BoundingBox(Point3D(bounds[0][c], bounds[1][c], bounds[2][c]), Point3D(bounds[3][c], bounds[4][c], bounds[5][c]));
+    }
+  };
+
+  // How good a tree is and what it cost to build, for weighing build time against trace time
+  struct Stats {
+    size_t nodes;
+    size_t leaves;
+    size_t objects; // Total over the leaves, which is also the number of objects the tree is over
+    size_t max_leaf_size;
+    int width; // 2 for the binary layout, WIDTH for the wide one
+    int depth; // Of the deepest leaf, the root being at depth 0
+    double sah_cost; // Expected cost of tracing a ray that hits the root, by the heuristic the tree was built with
+    double build_seconds; // 0 if the tree was loaded rather than built
+  };
+
+  BVH();
+
+  void build(const std::vector<BoundingBox>& bounds);
+
+  // Same as build(), but big trees are kept in the cache directory (see cachefile.hpp) under a hash of bounds.
+  // The tree only depends on the boxes, so building over exactly the same boxes again, whether they bound the
+  // triangles of an unchanged mesh or the instances of an unchanged scene, maps the saved tree instead
+  void build_cached(const std::vector<BoundingBox>& bounds);
+
+  // Uses a tree built earlier, e.g. one loaded from a cache file, instead of building one. The tree is in
+  // either nodes or wide_nodes, the other one being empty, and indices are the object indices its leaves refer
+  // to. Returns false, leaving the BVH empty, if the arrays don't make a valid tree over objects objects
+  bool assign(MappedArray<Node>&& nodes, MappedArray<WideNode, AlignedAllocator<WideNode> >&& wide_nodes,
+              MappedArray<unsigned int>&& indices, size_t objects);
+
+  // The tree's arrays, for writing it out. Only one of nodes() and wide_nodes() has anything in it
+  const MappedArray<Node>& nodes() const
+  {
+    return m_nodes;
+  }
+  const MappedArray<WideNode, AlignedAllocator<WideNode> >& wide_nodes() const
+  {
+    return m_wide;
+  }
+  const MappedArray<unsigned int>& indices() const
+  {
+    return m_indices;
+  }
+
+  bool empty() const
+  {
+    return m_nodes.empty() && m_wide.empty();
+  }
+
+  bool wide() const
+  {
+    return !m_wide.empty();
+  }
+
+  // Walks the whole tree, so not something to call per ray
+  Stats stats() const;
+
+  const BoundingBox& get_bounds() const
+  {
+    return m_bounds;
+  }
+
+  // Walks the tree front to back calling hit(index, tmax) on the objects in every leaf the ray passes through.
+  // hit() returns true if the object was hit at a distance less than tmax and lowers tmax to that distance, so
+  // nodes that lie entirely behind the closest hit found so far are never visited. tmax should start out no
+  // larger than ray.tmax()
+  template<typename F>
+  bool intersect(const Ray& ray, double& tmax, F hit) const;
+
+  // Any hit version of intersect() for occlusion queries. Calls hit(index) on objects in leaves the ray passes
+  // through between ray.tmin() and ray.tmax(), in no particular order, and returns true as soon as one of them
+  // returns true
+  template<typename F>
+  bool occluded(const Ray& ray, F hit) const;
+
+  // Walks the tree calling hit(index) on the objects in every leaf that at least one ray in the packet passes
+  // through. hit() is expected to lower the packet's t for the rays it hits, which culls nodes the same way
+  template<typename F>
+  void intersect(const RayPacket& packet, F hit) const;
+
+private:
+  MappedArray<Node> m_nodes;
+  MappedArray<WideNode, AlignedAllocator<WideNode> > m_wide;
+  MappedArray<unsigned int> m_indices;
+  std::shared_ptr<const MappedFile> m_file; // The cache file the arrays are in, if they were loaded from one
+  BoundingBox m_bounds;
+  double m_build_seconds;
+
+  // A node or leaf waiting on the wide layout's traversal stack, with the distance the ray enters it at
+  struct StackEntry {
+    unsigned int offset; // Index of the node, or for a leaf its first entry in m_indices
+    unsigned int count; // Number of objects in a leaf, 0 for a node
+    double tnear;
+  };
+  // Every node visited pushes at most WIDTH entries and pops one, and trees are never deeper than 64
+  static const int WIDE_STACK_SIZE = 64 * (WIDTH - 1) + 1;
+
+  void collapse();
+
+  template<typename F>
+  bool intersect_wide(const Ray& ray, double& tmax, F hit) const;
+  template<typename F>
+  bool occluded_wide(const Ray& ray, F hit) const;
+  template<typename F>
+  void intersect_wide(const RayPacket& packet, F hit) const;
+
+  static unsigned int hit_children(const WideNode& node, const Ray& ray, double tmax, double* tnear);
+};
+
+static_assert(sizeof(BVH::WideNode) == 128, "Wide BVH nodes should be two cache lines");
+
+// Whether trees built from now on are collapsed into the wide layout, the default, or left binary, for
+// comparing the two. Trees loaded from the cache are used in whichever layout they were saved in
+void set_wide_bvh(bool wide);
+bool wide_bvh();
+
+// One line summary, e.g. "341 4-wide nodes, 512 leaves of 2 objects on average and 4 at most, depth 6, SAH cost 31.4,
+// built in 0.01s"
+std::ostream& operator<<(std::ostream& out, const BVH::Stats& stats);
+
+template<typename F>
+bool BVH::intersect(const Ray& ray, double& tmax, F hit) const
+{
+  if(!m_wide.empty()) return intersect_wide(ray, tmax, hit);
+  if(m_nodes.empty()) return false;
+
+  bool intersected = false;
+  unsigned int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while(top > 0)
+  {
+    const Node& node = m_nodes[stack[--top]];
+
+    double tnear;
+    if(!node.bounds.intersect(ray, tmax, tnear)) continue;
+
+    if(node.count > 0)
+    {
+      for(unsigned int k = node.offset; k < node.offset + node.count; k++)
+      {
+        if(hit(m_indices[k], tmax)) intersected = true;
+      }
+      continue;
+    }
+
+    // Push the far child first so the near child is popped and tested first
+    unsigned int first = &node - &m_nodes[0] + 1, second = node.offset;
+    if(ray.sign(node.axis)) std::swap(first, second);
+    stack[top++] = second;
+    stack[top++] = first;
+  }
+
+  return intersected;
+}
+
+template<typename F>
+bool BVH::occluded(const Ray& ray, F hit) const
+{
+  if(!m_wide.empty()) return occluded_wide(ray, hit);
+  if(m_nodes.empty()) return false;
+
+  unsigned int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while(top > 0)
+  {
+    const Node& node = m_nodes[stack[--top]];
+
+    double tnear;
+    if(!node.bounds.intersect(ray, ray.tmax(), tnear)) continue;
+
+    if(node.count > 0)
+    {
+      for(unsigned int k = node.offset; k < node.offset + node.count; k++)
+      {
+        if(hit(m_indices[k])) return true;
+      }
+      continue;
+    }
+
+    stack[top++] = node.offset;
+    stack[top++] = &node - &m_nodes[0] + 1;
+  }
+
+  return false;
+}
+
+template<typename F>
+void BVH::intersect(const RayPacket& packet, F hit) const
+{
+  if(!m_wide.empty())
+  {
+    intersect_wide(packet, hit);
+    return;
+  }
+  if(m_nodes.empty()) return;
+
+  unsigned int stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while(top > 0)
+  {
+    const Node& node = m_nodes[stack[--top]];
+
+    if(!packet.hits(node.bounds)) continue;
+
+    if(node.count > 0)
+    {
+      for(unsigned int k = node.offset; k < node.offset + node.count; k++) hit(m_indices[k]);
+      continue;
+    }
+
+    // The rays in a packet are coherent so the first one is as good as any for picking the near child
+    unsigned int first = &node - &m_nodes[0] + 1, second = node.offset;
+    if(packet.d[node.axis][0] < 0) std::swap(first, second);
+    stack[top++] = second;
+    stack[top++] = first;
+  }
+}
+
+// Slab test of the ray against every child of the node at once, the same test as BoundingBox::intersect(). Returns
+// a bit for each child the ray passes through between ray.tmin() and tmax, with the distances it enters them at
+// in tnear
+inline unsigned int BVH::hit_children(const WideNode& node, const Ray& ray, double tmax, double* tnear)
+{
+  const Point3D& o = ray.origin();
+  const Vector3D& inv_dir = ray.inv_direction();
+  tmax = std::min(tmax, ray.tmax());
+
+  unsigned int mask = 0;
+  for(int k = 0; k < WIDTH; k += DVec::WIDTH)
+  {
+    DVec t0(ray.tmin()), t1(tmax);
+    for(int a = 0; a < 3; a++)
+    {
+      // Rays heading in the negative direction enter through the max side. A 0 * infinity NaN, from a ray lying
+      // in one of the planes, leaves t0 or t1 alone since min() and max() return their second argument then
+      DVec origin(o[a]), inv(inv_dir[a]);
+      DVec tn = (DVec::loadf(node.bounds[ray.sign(a) ? a + 3 : a] + k) - origin) * inv;
+      DVec tf = (DVec::loadf(node.bounds[ray.sign(a) ? a : a + 3] + k) - origin) * inv;
+      t0 = max(tn, t0);
+      t1 = min(tf, t1);
+    }
+    t0.storeu(tnear + k);
+    mask |= bits(t0 <= t1) << k;
+  }
+  return mask & ((1u << node.size) - 1);
+}
+
+template<typename F>
+bool BVH::intersect_wide(const Ray& ray, double& tmax, F hit) const
+{
+  bool intersected = false;
+  StackEntry stack[WIDE_STACK_SIZE];
+  int top = 0;
+  stack[top].offset = 0;
+  stack[top].count = 0;
+  stack[top++].tnear = ray.tmin();
+
+  while(top > 0)
+  {
+    StackEntry entry = stack[--top];
+
+    // Skip anything a hit found since it was pushed is in front of
+    if(entry.tnear > tmax) continue;
+
+    if(entry.count > 0)
+    {
+      for(unsigned int k = entry.offset; k < entry.offset + entry.count; k++)
+      {
+        if(hit(m_indices[k], tmax)) intersected = true;
+      }
+      continue;
+    }
+
+    const WideNode& node = m_wide[entry.offset];
+    double tnear[WIDTH];
+    unsigned int mask = hit_children(node, ray, tmax, tnear);
+
+    // Push the children the ray passes through furthest first, so the nearest is popped and visited first
+    int first = top;
+    for(unsigned int c = 0; c < node.size; c++)
+    {
+      if(!(mask & (1u << c))) continue;
+      int k = top++;
+      for(; k > first && stack[k - 1].tnear < tnear[c]; k--) stack[k] = stack[k - 1];
+      stack[k].offset = node.offset[c];
+      stack[k].count = node.count[c];
+      stack[k].tnear = tnear[c];
+    }
+  }
+
+  return intersected;
+}
+
+template<typename F>
+bool BVH::occluded_wide(const Ray& ray, F hit) const
+{
+  unsigned int stack[WIDE_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+
+  while(top > 0)
+  {
+    const WideNode& node = m_wide[stack[--top]];
+    double tnear[WIDTH];
+    unsigned int mask = hit_children(node, ray, ray.tmax(), tnear);
+
+    // Leaves are tested straight away, any hit will do
+    for(unsigned int c = 0; c < node.size; c++)
+    {
+      if(!(mask & (1u << c))) continue;
+      if(node.count[c] == 0)
+      {
+        stack[top++] = node.offset[c];
+        continue;
+      }
+      for(unsigned int k = node.offset[c]; k < node.offset[c] + node.count[c]; k++)
+      {
+        if(hit(m_indices[k])) return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+template<typename F>
+void BVH::intersect_wide(const RayPacket& packet, F hit) const
+{
+  // Entries are children to be tested rather than nodes already tested: the packet's t shrinks as hits are found,
+  // so testing a child's box only once it comes off the stack culls more, the same as the binary layout does.
+  // offset is the node the child is in and count its slot
+  StackEntry stack[WIDE_STACK_SIZE];
+  int top = 0;
+  const WideNode* node = &m_wide[0];
+
+  for(;;)
+  {
+    // The rays in a packet are coherent, so children are ordered by how far along the first ray their centres are
+    // and pushed furthest first
+    int first = top;
+    for(unsigned int c = 0; c < node->size; c++)
+    {
+      double distance = 0.0;
+      for(int a = 0; a < 3; a++)
+      {
+        distance += (0.5 * ((double)node->bounds[a][c] + node->bounds[a + 3][c]) - packet.o[a][0]) * packet.d[a][0];
+      }
+
+      int k = top++;
+      for(; k > first && stack[k - 1].tnear < distance; k--) stack[k] = stack[k - 1];
+      stack[k].offset = node - &m_wide[0];
+      stack[k].count = c;
+      stack[k].tnear = distance;
+    }
+
+    // Pop children until one the packet passes through is an interior node
+    node = NULL;
+    while(top > 0 && !node)
+    {
+      const StackEntry& entry = stack[--top];
+      const WideNode& parent = m_wide[entry.offset];
+      unsigned int c = entry.count;
+      if(!packet.hits(parent.child_bounds(c))) continue;
+
+      if(parent.count[c] == 0)
+      {
+        node = &m_wide[parent.offset[c]];
+        continue;
+      }
+      for(unsigned int k = parent.offset[c]; k < parent.offset[c] + parent.count[c]; k++) hit(m_indices[k]);
+    }
+    if(!node) break;
+  }
+}
+
+#endif
@@ -0,0 +1,200 @@
+#include "cachefile.hpp"
+#include "mappedfile.hpp"
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Written as a native unsigned int, so a file from a machine of the other endianness reads differently
+static const unsigned int BYTE_ORDER_MARK = 0x01020304;
+
+// Sections start on cache line boundaries
+static const size_t SECTION_ALIGN = 64;
+
+static const unsigned int MAX_SECTIONS = 8;
+
+struct CacheFileHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int byte_order;
+  unsigned long long key;
+  unsigned int section_count;
+  unsigned int padding;
+  struct {
+    unsigned long long offset; // From the start of the file
+    unsigned long long count;
+    unsigned long long element_size;
+  } sections[MAX_SECTIONS];
+};
+
+static std::string s_cache_dir = ".rtcache";
+
+static size_t align(size_t offset)
+{
+  return (offset + SECTION_ALIGN - 1) / SECTION_ALIGN * SECTION_ALIGN;
+}
+
+unsigned long long fnv1a(const void* data, size_t size, unsigned long long hash)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for(size_t i = 0; i < size; i++)
+  {
+    hash ^= p[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+unsigned long long hash_words(const void* data, size_t size)
+{
+  // Each word is folded in with a multiply, and the shift brings its high bits back down so every bit of the
+  // word ends up affecting every bit of the hash. The bytes left over at the end go through fnv1a()
+  const char* p = static_cast<const char*>(data);
+  unsigned long long hash = 0xcbf29ce484222325ull ^ size;
+  size_t words = size / 8;
+  for(size_t i = 0; i < words; i++)
+  {
+    unsigned long long word;
+    std::memcpy(&word, p + 8*i, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+  }
+  return fnv1a(p + 8*words, size - 8*words, hash);
+}
+
+const std::string& cache_dir()
+{
+  return s_cache_dir;
+}
+
+void set_cache_dir(const std::string& dir)
+{
+  s_cache_dir = dir;
+}
+
+std::string cache_path(unsigned long long key, const char* extension)
+{
+  if(s_cache_dir.empty()) return std::string();
+
+  // Fails harmlessly if it's already there, and if it can't be made the file just can't be written
+  mkdir(s_cache_dir.c_str(), 0777);
+
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx", key);
+  return s_cache_dir + "/" + name + extension;
+}
+
+bool write_cache_file(const std::string& filename, const char* magic, unsigned int version, unsigned long long key,
+                      const std::vector<CacheSection>& sections, std::string& error)
+{
+  if(sections.size() > MAX_SECTIONS)
+  {
+    error = "Too many sections for " + filename;
+    return false;
+  }
+
+  CacheFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, magic, sizeof(header.magic));
+  header.version = version;
+  header.byte_order = BYTE_ORDER_MARK;
+  header.key = key;
+  header.section_count = sections.size();
+
+  size_t offset = align(sizeof(header));
+  for(size_t i = 0; i < sections.size(); i++)
+  {
+    header.sections[i].offset = offset;
+    header.sections[i].count = sections[i].count;
+    header.sections[i].element_size = sections[i].element_size;
+    offset = align(offset + sections[i].count * sections[i].element_size);
+  }
+
+  std::ostringstream temp;
+  temp << filename << ".tmp" << getpid();
+  FILE* out = std::fopen(temp.str().c_str(), "wb");
+  if(!out)
+  {
+    error = "Couldn't create " + temp.str();
+    return false;
+  }
+
+  static const char zeros[SECTION_ALIGN] = {0};
+  bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+  size_t written = sizeof(header);
+  for(size_t i = 0; i < sections.size() && ok; i++)
+  {
+    size_t padding = header.sections[i].offset - written;
+    size_t bytes = sections[i].count * sections[i].element_size;
+    ok = std::fwrite(zeros, 1, padding, out) == padding
+      && (bytes == 0 || std::fwrite(sections[i].data, 1, bytes, out) == bytes);
+    written += padding + bytes;
+  }
+  ok = (std::fclose(out) == 0) && ok;
+
+  if(!ok || std::rename(temp.str().c_str(), filename.c_str()) != 0)
+  {
+    std::remove(temp.str().c_str());
+    error = "Couldn't write " + filename;
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<const MappedFile> read_cache_file(const std::string& filename, const char* magic,
+                                                  unsigned int version, unsigned long long key,
+                                                  std::vector<CacheSection>& sections, std::string& error)
+{
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+  if(!file->open(filename))
+  {
+    error = "Couldn't open " + filename;
+    return NULL;
+  }
+  const char* data = file->data();
+  size_t size = file->size();
+
+  CacheFileHeader header;
+  if(size < sizeof(header))
+  {
+    error = filename + " isn't the right kind of file";
+    return NULL;
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if(std::memcmp(header.magic, magic, sizeof(header.magic)) != 0)
+  {
+    error = filename + " isn't the right kind of file";
+    return NULL;
+  }
+  if(header.version != version || header.byte_order != BYTE_ORDER_MARK || header.section_count != sections.size())
+  {
+    error = filename + " was written by a different version or build of rt";
+    return NULL;
+  }
+  if(key != 0 && header.key != key)
+  {
+    error = filename + " is out of date";
+    return NULL;
+  }
+
+  for(size_t i = 0; i < sections.size(); i++)
+  {
+    unsigned long long offset = header.sections[i].offset, count = header.sections[i].count;
+    // Element sizes depend on how rt was built, e.g. with CS488_FLOAT_GEOMETRY
+    if(header.sections[i].element_size != sections[i].element_size)
+    {
+      error = filename + " was written by a different version or build of rt";
+      return NULL;
+    }
+    if(offset % SECTION_ALIGN != 0 || offset > size || count > (size - offset) / sections[i].element_size)
+    {
+      error = filename + " is corrupt";
+      return NULL;
+    }
+    sections[i].data = data + offset;
+    sections[i].count = count;
+  }
+
+  return file;
+}
@@ -0,0 +1,52 @@
+#ifndef CS488_CACHEFILE_HPP
+#define CS488_CACHEFILE_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+class MappedFile;
+
+// Files in the on-disk cache of meshes and BVHs. Each one is a versioned header followed by sections of plain
+// arrays, every section starting on a 64 byte boundary so the arrays can be used in place once the file is
+// mapped.
+
+// 64 bit FNV-1a hash of size bytes at data, continuing from hash
+unsigned long long fnv1a(const void* data, size_t size, unsigned long long hash = 0xcbf29ce484222325ull);
+
+// Hash of size bytes at data, taken 8 bytes at a time for keying on whole files, which fnv1a() would spend
+// longer on than mapping a cached copy takes. Not the same hash as fnv1a()
+unsigned long long hash_words(const void* data, size_t size);
+
+// The directory cached files go in, by default .rtcache in the current directory. An empty string turns
+// caching off
+const std::string& cache_dir();
+void set_cache_dir(const std::string& dir);
+
+// Where the cached file for key with the given extension goes, creating the cache directory if it doesn't
+// exist yet. Empty if caching is off
+std::string cache_path(unsigned long long key, const char* extension);
+
+// One array in a cache file
+struct CacheSection {
+  const void* data;
+  size_t element_size;
+  size_t count;
+};
+
+// Writes the sections to filename after a header holding magic (8 characters), version and key. The file is
+// written under a temporary name and renamed into place, so nothing (another render sharing the cache, say)
+// ever maps a half written file. Returns false with a message in error if it can't be written
+bool write_cache_file(const std::string& filename, const char* magic, unsigned int version, unsigned long long key,
+                      const std::vector<CacheSection>& sections, std::string& error);
+
+// Maps a file written by write_cache_file(). It has to have the same magic, version and byte order, the same
+// key unless key is 0, and as many sections as sections holds with the same element sizes. Sets the data and
+// count of each section to the array in the file and returns the file, which has to stay mapped for as long as
+// they're used. Returns NULL with a message in error if anything doesn't match
+std::shared_ptr<const MappedFile> read_cache_file(const std::string& filename, const char* magic,
+                                                  unsigned int version, unsigned long long key,
+                                                  std::vector<CacheSection>& sections, std::string& error);
+
+#endif
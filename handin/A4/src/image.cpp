@@ -4,152 +4,515 @@
 #include <cstdio>
 #include <cmath>
 #include <png.h>
+#include <zlib.h>
+#include <algorithm>
 #include <sstream>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include "threadpool.hpp"
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static unsigned int float_bits(float f)
+{
+  unsigned int x;
+  std::memcpy(&x, &f, sizeof(x));
+  return x;
+}
+
+static float bits_float(unsigned int x)
+{
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+unsigned short Half::from_float(float f)
+{
+  unsigned int x = float_bits(f);
+  unsigned short sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+
+  // Infinity stays infinity, NaN stays a (quiet) NaN
+  if (x >= 0x7f800000) return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+  // Anything that rounds past 65504, the largest half, overflows
+  if (x >= 0x477ff000) return sign | 0x7c00;
+
+  if (x < 0x38800000) {
+    // Below the smallest normal half. Adding 0.5 lines the bits the half keeps up with the
+    // bottom of the float's mantissa, so the FPU does the round to nearest even for us
+    float v = bits_float(x) + 0.5f;
+    return sign | (float_bits(v) - 0x3f000000);
+  }
+
+  // Rebias the exponent and round the 13 dropped mantissa bits to nearest even. A carry out of
+  // the mantissa correctly bumps the exponent
+  x -= (127 - 15) << 23;
+  x += 0xfff + ((x >> 13) & 1);
+  return sign | (x >> 13);
+}
+
+float Half::to_float(unsigned short h)
+{
+  unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+  unsigned int exponent = (h >> 10) & 0x1f;
+  unsigned int mantissa = h & 0x3ff;
+
+  if (exponent == 0) {
+    // Zero or denormal, exactly mantissa * 2^-24
+    float v = mantissa * (1.0f / 16777216.0f);
+    return sign ? -v : v;
+  }
+  if (exponent == 31) return bits_float(sign | 0x7f800000 | (mantissa << 13));
+  return bits_float(sign | ((exponent + 127 - 15) << 23) | (mantissa << 13));
+}
+
+void convert_channels(const float* src, Half* dst, size_t n)
+{
+  size_t i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+  }
+#endif
+  for (; i < n; i++) dst[i] = Half(src[i]);
+}
+
+void convert_channels(const Half* src, float* dst, size_t n)
+{
+  size_t i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+#endif
+  for (; i < n; i++) dst[i] = src[i];
+}
+
+void convert_channels(const float* src, Unorm8* dst, size_t n)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  // 16 channels at a time: clamp, scale, truncate to int like the scalar version, then pack
+  // down to bytes. max comes first so NaN clamps to 0
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), scale = _mm_set1_ps(255.0f);
+  __m128i q[4];
+  for (; i + 16 <= n; i += 16) {
+    for (int k = 0; k < 4; k++) {
+      __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4*k), zero), one);
+      q[k] = _mm_cvttps_epi32(_mm_mul_ps(x, scale));
+    }
+    __m128i b = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), b);
+  }
+#endif
+  for (; i < n; i++) dst[i] = Unorm8(src[i]);
+}
+
+void convert_channels(const Unorm8* src, float* dst, size_t n)
+{
+  for (size_t i = 0; i < n; i++) dst[i] = src[i];
+}
 
-Image::Image()
+template<typename T>
+BasicImage<T>::BasicImage()
   : m_width(0), m_height(0), m_elements(0), m_data(0)
 {
 }
 
-Image::Image(int width, int height, int elements)
+template<typename T>
+BasicImage<T>::BasicImage(int width, int height, int elements)
   : m_width(width), m_height(height), m_elements(elements),
-    m_data(new double[m_width * m_height * m_elements])
+    m_data(allocate(size()))
 {
+  std::fill(m_data, m_data + size(), T());
 }
 
-Image::Image(const Image& other)
+template<typename T>
+BasicImage<T>::BasicImage(const BasicImage& other)
   : m_width(other.m_width), m_height(other.m_height), m_elements(other.m_elements),
-    m_data(other.m_data ? new double[m_width * m_height * m_elements] : 0)
+    m_data(other.m_data ? allocate(size()) : 0)
 {
   if (m_data) {
-    std::memcpy(m_data, other.m_data,
-                m_width * m_height * m_elements * sizeof(double));
+    std::memcpy(m_data, other.m_data, size() * sizeof(T));
   }
 }
 
-Image::~Image()
+template<typename T>
+BasicImage<T>::BasicImage(BasicImage&& other)
+  : m_width(other.m_width), m_height(other.m_height), m_elements(other.m_elements),
+    m_data(other.m_data)
 {
-  delete [] m_data;
+  other.m_width = other.m_height = other.m_elements = 0;
+  other.m_data = 0;
 }
 
-Image& Image::operator=(const Image& other)
+template<typename T>
+BasicImage<T>::~BasicImage()
 {
-  delete [] m_data;
+  deallocate(m_data);
+}
+
+template<typename T>
+BasicImage<T>& BasicImage<T>::operator=(const BasicImage& other)
+{
+  if (this == &other) return *this;
+
+  // Keep the buffer if it's already the right size
+  if (!other.m_data || size() != other.size()) {
+    deallocate(m_data);
+    m_data = (other.m_data ? allocate(other.size()) : 0);
+  }
   
   m_width = other.m_width;
   m_height = other.m_height;
   m_elements = other.m_elements;
-  m_data = (other.m_data ? new double[m_width * m_height * m_elements] : 0);
 
   if (m_data) {
-    std::memcpy(m_data,
-                other.m_data,
-                m_width * m_height * m_elements * sizeof(double));
+    std::memcpy(m_data, other.m_data, size() * sizeof(T));
   }
   
   return *this;
 }
 
-int Image::width() const
+template<typename T>
+BasicImage<T>& BasicImage<T>::operator=(BasicImage&& other)
+{
+  if (this == &other) return *this;
+
+  deallocate(m_data);
+
+  m_width = other.m_width;
+  m_height = other.m_height;
+  m_elements = other.m_elements;
+  m_data = other.m_data;
+
+  other.m_width = other.m_height = other.m_elements = 0;
+  other.m_data = 0;
+
+  return *this;
+}
+
+// Channel data starts on a cache line so the renderer's threads and the SIMD conversions
+// never split a line at the start of the buffer
+template<typename T>
+T* BasicImage<T>::allocate(size_t n)
 {
-  return m_width;
+  void* p = 0;
+  if (posix_memalign(&p, 64, std::max<size_t>(n, 1) * sizeof(T))) throw std::bad_alloc();
+  return static_cast<T*>(p);
 }
 
-int Image::height() const
+template<typename T>
+void BasicImage<T>::deallocate(T* p)
 {
-  return m_height;
+  std::free(p);
 }
 
-int Image::elements() const
+template<typename T>
+bool BasicImage<T>::savePng(const std::string& filename, const PngOptions& options) const
 {
-  return m_elements;
+  PngWriter writer;
+  return writer.open(filename, m_width, m_height, m_elements, options)
+      && writer.write_rows(*this, m_height)
+      && writer.close();
 }
 
-double Image::operator()(int x, int y, int i) const
+// Bands are cut into strips of about this many bytes of pixels, each filtered and deflated as one task
+static const size_t PNG_STRIP_BYTES = 128 * 1024;
+
+// How far back deflate can look for matches. Each strip is primed with this much of the data before it
+static const size_t DEFLATE_WINDOW = 32768;
+
+struct PngWriter::State {
+  FILE* fout;
+  int width, height, elements;
+  PngOptions options;
+  int rows; // Rows written so far
+  std::vector<Unorm8> prev; // The last row written, the next band's first row is filtered against it
+  std::vector<unsigned char> window; // The end of the filtered data so far, up to DEFLATE_WINDOW bytes
+  uLong adler; // Adler-32 of all the filtered data so far, the zlib stream ends with it
+};
+
+PngWriter::PngWriter()
+  : m_state(0)
 {
-  return m_data[m_elements * (m_width * y + x) + i];
 }
 
-double& Image::operator()(int x, int y, int i)
+// Frees state, returning false if the file couldn't be closed
+static bool destroy_state(PngWriter::State* state)
 {
-  return m_data[m_elements * (m_width * y + x) + i];
+  bool ok = std::fclose(state->fout) == 0;
+  delete state;
+  return ok;
 }
 
-bool Image::savePng(const std::string& filename)
+PngWriter::~PngWriter()
 {
-  FILE* fout = std::fopen(filename.c_str(), "wb");
-  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  png_infop info_ptr = png_create_info_struct(png_ptr);
-  setjmp(png_ptr->jmpbuf);
+  // Closed early, whatever was written is useless
+  if (m_state) destroy_state(m_state);
+}
 
-  /* Setup PNG I/O */
-  png_init_io(png_ptr, fout);
-	 
-  /* Optionally setup a callback to indicate when a row has been
-   * written. */  
+static void put_u32(unsigned char* p, unsigned long x)
+{
+  p[0] = x >> 24;
+  p[1] = x >> 16;
+  p[2] = x >> 8;
+  p[3] = x;
+}
 
-  /* Setup filtering. Use Paeth filtering */
-  png_set_filter(png_ptr, 0, PNG_FILTER_PAETH);
+// Writes one PNG chunk: the length of its data, its type, the data and the CRC of the type and data
+static bool write_chunk(FILE* fout, const char* type, const unsigned char* data, size_t length)
+{
+  unsigned char header[8], footer[4];
+  put_u32(header, length);
+  std::memcpy(header + 4, type, 4);
+  uLong crc = crc32(0, header + 4, 4);
+  if (length) crc = crc32(crc, data, length);
+  put_u32(footer, crc);
+
+  return std::fwrite(header, 1, 8, fout) == 8
+      && (!length || std::fwrite(data, 1, length, fout) == length)
+      && std::fwrite(footer, 1, 4, fout) == 4;
+}
 
-  /* Setup compression level. */
-  png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+// Calls task(0) to task(n - 1), on pool if there is one
+static void parallel_for(ThreadPool* pool, size_t n, const std::function<void(size_t)>& task)
+{
+  if (pool) {
+    pool->parallel_for(n, task);
+  } else {
+    for (size_t i = 0; i < n; i++) task(i);
+  }
+}
 
-  /* Setup PNG header information and write it to the file */
+static inline int paeth_predictor(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  return pb <= pc ? b : c;
+}
 
-  int color_type;
-  switch (m_elements) {
-  case 1:
-    color_type = PNG_COLOR_TYPE_GRAY;
+// Applies one of the PNG filter types (NONE to PAETH, numbered as in the PNG spec) to the n bytes of row.
+// above is the unfiltered row above it and bpp the bytes per pixel, how far back the byte to the left is
+static void filter_bytes(int type, const unsigned char* row, const unsigned char* above, size_t n, size_t bpp,
+                         unsigned char* out)
+{
+  switch (type) {
+  case PngOptions::NONE:
+    std::memcpy(out, row, n);
     break;
-  case 2:
-    color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+  case PngOptions::SUB:
+    for (size_t i = 0; i < n; i++) out[i] = row[i] - (i >= bpp ? row[i - bpp] : 0);
     break;
-  case 3:
-    color_type = PNG_COLOR_TYPE_RGB;
+  case PngOptions::UP:
+    for (size_t i = 0; i < n; i++) out[i] = row[i] - above[i];
     break;
-  case 4:
-    color_type = PNG_COLOR_TYPE_RGBA;
+  case PngOptions::AVERAGE:
+    for (size_t i = 0; i < n; i++) out[i] = row[i] - (((i >= bpp ? row[i - bpp] : 0) + above[i]) >> 1);
     break;
   default:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = row[i] - (i >= bpp ? paeth_predictor(row[i - bpp], above[i], above[i - bpp])
+                                  : paeth_predictor(0, above[i], 0));
+    }
+    break;
+  }
+}
+
+// Writes the filter type byte and the filtered row to out. ADAPTIVE tries every filter and keeps the one
+// whose output, read as signed bytes, has the smallest sum of absolute values, the same guess libpng makes
+static void filter_row(PngOptions::Filter filter, const unsigned char* row, const unsigned char* above,
+                       size_t n, size_t bpp, unsigned char* out, std::vector<unsigned char>& scratch)
+{
+  if (filter != PngOptions::ADAPTIVE) {
+    out[0] = filter;
+    filter_bytes(filter, row, above, n, bpp, out + 1);
+    return;
+  }
+
+  scratch.resize(n);
+  unsigned long best = ~0ul;
+  for (int type = PngOptions::NONE; type <= PngOptions::PAETH; type++) {
+    filter_bytes(type, row, above, n, bpp, &scratch[0]);
+    unsigned long sum = 0;
+    for (size_t i = 0; i < n && sum < best; i++) sum += std::abs((int)(signed char)scratch[i]);
+    if (sum < best) {
+      best = sum;
+      out[0] = type;
+      std::memcpy(out + 1, &scratch[0], n);
+    }
+  }
+}
+
+bool PngWriter::open(const std::string& filename, int width, int height, int elements, const PngOptions& options)
+{
+  // Grey, grey and alpha, RGB and RGBA
+  static const unsigned char colour_types[] = {0, 4, 2, 6};
+  if (width <= 0 || height <= 0 || elements < 1 || elements > 4) return false;
+
+  FILE* fout = std::fopen(filename.c_str(), "wb");
+  if (!fout) return false;
+
+  static const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+  // Size, 8 bits per channel, the colour type, then deflate, the standard filters and no interlacing
+  unsigned char ihdr[13];
+  put_u32(ihdr, width);
+  put_u32(ihdr + 4, height);
+  ihdr[8] = 8;
+  ihdr[9] = colour_types[elements - 1];
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  // The image data is one zlib stream. Its header says deflate with a 32K window and how hard the compressor
+  // tried, and is padded out with check bits to make it a multiple of 31
+  // -1 asks for zlib's default, which is 6
+  int level = (options.level == -1) ? 6 : std::min(9, std::max(0, options.level));
+  unsigned char zlib_header[2] = {0x78, (unsigned char)((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6)};
+  zlib_header[1] += (31 - (zlib_header[0] * 256 + zlib_header[1]) % 31) % 31;
+
+  if (std::fwrite(signature, 1, 8, fout) != 8
+      || !write_chunk(fout, "IHDR", ihdr, 13)
+      || !write_chunk(fout, "IDAT", zlib_header, 2)) {
+    std::fclose(fout);
     return false;
   }
-   
-  png_set_IHDR(png_ptr, info_ptr,
-               m_width, m_height,
-               8, 
-               color_type,
-               PNG_INTERLACE_NONE, 
-               PNG_COMPRESSION_TYPE_DEFAULT, 
-               PNG_FILTER_TYPE_DEFAULT);
-  png_write_info(png_ptr, info_ptr); 
-    
-  // Actual writing
-  png_byte* tempLine = new png_byte[m_width * m_elements];
-  
-  for(int i=0;i<m_height;i++){
-    for(int j=0;j<m_width;j++){
-      for(int k = 0;k<m_elements;k++) {
-        // Clamp the value
-        double value = std::min(1.0, std::max(0.0, (*this)(j, i, k)));
-        
-        // Write it out
-        tempLine[m_elements*j+k] = static_cast<png_byte>(value*255.0); 
-      }
+
+  m_state = new State;
+  m_state->fout = fout;
+  m_state->width = width;
+  m_state->height = height;
+  m_state->elements = elements;
+  m_state->options = options;
+  m_state->options.level = level;
+  m_state->rows = 0;
+  m_state->prev.assign((size_t)width * elements, Unorm8());
+  m_state->adler = adler32(0, 0, 0);
+  return true;
+}
+
+template<typename T>
+bool PngWriter::write_rows(const BasicImage<T>& band, int rows)
+{
+  if (!m_state || band.width() != m_state->width || band.elements() != m_state->elements) return false;
+  if (rows < 0 || rows > band.height() || m_state->rows + rows > m_state->height) return false;
+  if (rows == 0) return true;
+
+  State& state = *m_state;
+  size_t n = (size_t)state.width * state.elements;
+  size_t stride = n + 1; // Filtered rows start with their filter type
+  size_t strip_rows = std::max<size_t>(1, PNG_STRIP_BYTES / stride);
+  size_t strips = (rows + strip_rows - 1) / strip_rows;
+  bool last = state.rows + rows == state.height;
+
+  // Quantize and filter each strip. The filters look at the row above, so each strip converts the row before
+  // it too, or for the first one uses the last row of the band before
+  std::vector<unsigned char> filtered(rows * stride);
+  parallel_for(state.options.pool, strips, [&](size_t s) {
+    size_t r0 = s * strip_rows, r1 = std::min((size_t)rows, r0 + strip_rows);
+    std::vector<Unorm8> above(n), row(n);
+    std::vector<unsigned char> scratch;
+    if (r0 == 0) above = state.prev;
+    else convert_channels(band.data() + (r0 - 1) * n, &above[0], n);
+
+    for (size_t r = r0; r < r1; r++) {
+      convert_channels(band.data() + r * n, &row[0], n);
+      filter_row(state.options.filter, reinterpret_cast<const unsigned char*>(&row[0]),
+                 reinterpret_cast<const unsigned char*>(&above[0]), n, state.elements, &filtered[r * stride], scratch);
+      std::swap(above, row);
+    }
+  });
+  convert_channels(band.data() + (rows - 1) * n, &state.prev[0], n);
+
+  // Deflate each strip on its own, primed with the data just before it so little is lost to the split. All but
+  // the very last strip of the image end with a sync flush, which ends on a byte boundary without ending the
+  // stream, so the strips can be written one after another as a single stream
+  std::vector< std::vector<unsigned char> > out(strips);
+  std::vector<uLong> adlers(strips);
+  std::atomic<bool> ok(true);
+  parallel_for(state.options.pool, strips, [&](size_t s) {
+    size_t b0 = s * strip_rows * stride, b1 = std::min(filtered.size(), b0 + strip_rows * stride);
+    adlers[s] = adler32(adler32(0, 0, 0), &filtered[b0], b1 - b0);
+
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, state.options.level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      ok = false;
+      return;
+    }
+    if (s > 0) {
+      size_t d = std::min(b0, DEFLATE_WINDOW);
+      deflateSetDictionary(&z, &filtered[b0 - d], d);
+    } else if (!state.window.empty()) {
+      deflateSetDictionary(&z, &state.window[0], state.window.size());
     }
-    png_write_row(png_ptr, tempLine);
+
+    int flush = (last && s == strips - 1) ? Z_FINISH : Z_SYNC_FLUSH;
+    std::vector<unsigned char>& buffer = out[s];
+    buffer.resize(deflateBound(&z, b1 - b0) + 16);
+    z.next_in = &filtered[b0];
+    z.avail_in = b1 - b0;
+    size_t produced = 0;
+    int ret;
+    do {
+      if (produced == buffer.size()) buffer.resize(2 * buffer.size());
+      z.next_out = &buffer[produced];
+      z.avail_out = buffer.size() - produced;
+      ret = deflate(&z, flush);
+      produced = buffer.size() - z.avail_out;
+    } while (ret == Z_OK && (flush == Z_FINISH || z.avail_out == 0));
+    buffer.resize(produced);
+
+    if (ret != (flush == Z_FINISH ? Z_STREAM_END : Z_OK)) ok = false;
+    deflateEnd(&z);
+  });
+  if (!ok) return false;
+
+  for (size_t s = 0; s < strips; s++) {
+    size_t length = std::min(filtered.size() - s * strip_rows * stride, strip_rows * stride);
+    state.adler = adler32_combine(state.adler, adlers[s], length);
+    if (!write_chunk(state.fout, "IDAT", &out[s][0], out[s].size())) return false;
+  }
+  if (last) {
+    unsigned char trailer[4];
+    put_u32(trailer, state.adler);
+    if (!write_chunk(state.fout, "IDAT", trailer, 4)) return false;
+  }
+
+  // Keep the end of the data to prime the next band's first strip
+  state.window.insert(state.window.end(), filtered.end() - std::min(filtered.size(), DEFLATE_WINDOW), filtered.end());
+  if (state.window.size() > DEFLATE_WINDOW) {
+    state.window.erase(state.window.begin(), state.window.end() - DEFLATE_WINDOW);
   }
-  
-  delete [] tempLine;
-  
-  // closing and freeing the structs
-  png_write_end(png_ptr, info_ptr);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-  fclose(fout);
 
+  state.rows += rows;
   return true;
 }
 
-bool Image::loadPng(const std::string& filename)
+bool PngWriter::close()
+{
+  if (!m_state) return false;
+
+  State* state = m_state;
+  m_state = 0;
+
+  // Without every row the image data would be cut short
+  bool ok = state->rows == state->height && write_chunk(state->fout, "IEND", 0, 0);
+  return destroy_state(state) && ok;
+}
+
+template<typename T>
+bool BasicImage<T>::loadPng(const std::string& filename)
 {
   // check that the file is a png file
   png_byte buf[8];
@@ -212,7 +575,7 @@ bool Image::loadPng(const std::string& filename)
     return false;
   }
 
-  delete [] m_data;
+  deallocate(m_data);
 
   m_width = png_get_image_width(png_ptr, info_ptr);
   m_height = png_get_image_height(png_ptr, info_ptr);
@@ -230,13 +593,13 @@ bool Image::loadPng(const std::string& filename)
   
   png_bytep* row_pointers = png_get_rows(png_ptr, info_ptr);
 
-  m_data = new double[m_width * m_height * m_elements];
+  m_data = allocate(size());
 
   for (int y = 0; y < m_height; y++) {
     for (int x = 0; x < m_width; x++) {
       for (int i = 0; i < m_elements; i++) {
 	png_byte *row = row_pointers[y];
-	int index = m_elements * (y * m_width + x) + i;
+	size_t index = m_elements * ((size_t)y * m_width + x) + i;
 	
         long element = 0;
         for (int j = bit_depth/8 - 1; j >= 0; j--) {
@@ -244,7 +607,7 @@ bool Image::loadPng(const std::string& filename)
           element += row[(x * m_elements + i) * bit_depth/8 + j];
         }
         
-	m_data[index] = element / static_cast<double>((1 << bit_depth) - 1);
+	m_data[index] = T(element / static_cast<double>((1 << bit_depth) - 1));
       }
     }
   }
@@ -254,12 +617,12 @@ bool Image::loadPng(const std::string& filename)
   return true;
 }
 
-const double* Image::data() const
-{
-  return m_data;
-}
-
-double* Image::data()
-{
-  return m_data;
-}
+// Every storage type the renderer and tools use
+template class BasicImage<double>;
+template class BasicImage<float>;
+template class BasicImage<Half>;
+template class BasicImage<Unorm8>;
+template bool PngWriter::write_rows(const BasicImage<double>& band, int rows);
+template bool PngWriter::write_rows(const BasicImage<float>& band, int rows);
+template bool PngWriter::write_rows(const BasicImage<Half>& band, int rows);
+template bool PngWriter::write_rows(const BasicImage<Unorm8>& band, int rows);
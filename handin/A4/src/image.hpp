@@ -2,51 +2,194 @@
 #define CS488_IMAGE_HPP
 
 #include <string>
+#include <cstddef>
+#include <algorithm>
 
-/** An image, consisting of a rectangle of floating-point elements.
+/** A 16 bit floating point number (IEEE 754 half precision), for
+ * storing channels at half the size of a float. Converts to and from
+ * float, rounding to the nearest half.
+ */
+class Half {
+public:
+  Half() : bits_(0) {}
+  Half(float f) : bits_(from_float(f)) {}
+
+  operator float() const { return to_float(bits_); }
+
+  static unsigned short from_float(float f);
+  static float to_float(unsigned short h);
+
+private:
+  unsigned short bits_;
+};
+
+/** An 8 bit channel holding a value in [0.0, 1.0] as an integer in
+ * [0, 255], the same as a PNG file. Values outside [0.0, 1.0] are
+ * clamped when they are stored.
+ */
+class Unorm8 {
+public:
+  Unorm8() : bits_(0) {}
+  Unorm8(float f) : bits_(static_cast<unsigned char>(std::min(1.0f, std::max(0.0f, f)) * 255.0f)) {}
+
+  operator float() const { return bits_ / 255.0f; }
+
+private:
+  unsigned char bits_;
+};
+
+/** Converts n channels from one storage type to another. The
+ * conversions between float and Half or Unorm8 are the ones images
+ * spend their time in and are vectorized, everything else goes
+ * through float.
+ */
+template<typename U, typename T>
+inline void convert_channels(const U* src, T* dst, size_t n)
+{
+  for (size_t i = 0; i < n; i++) dst[i] = T(static_cast<float>(src[i]));
+}
+template<typename T>
+inline void convert_channels(const T* src, T* dst, size_t n)
+{
+  std::copy(src, src + n, dst);
+}
+void convert_channels(const float* src, Half* dst, size_t n);
+void convert_channels(const Half* src, float* dst, size_t n);
+void convert_channels(const float* src, Unorm8* dst, size_t n);
+void convert_channels(const Unorm8* src, float* dst, size_t n);
+
+class ThreadPool;
+
+/** How PNG files are written. The level is zlib's, from 0 (no
+ * compression) to 9 (smallest and slowest), or -1 for zlib's default
+ * of 6. Each row is filtered
+ * before it is compressed: NONE, SUB, UP, AVERAGE and PAETH are the
+ * PNG filter types, ADAPTIVE picks whichever one suits each row best.
+ */
+struct PngOptions {
+  enum Filter { NONE, SUB, UP, AVERAGE, PAETH, ADAPTIVE };
+
+  PngOptions() : level(6), filter(PAETH), pool(0) {}
+
+  int level;
+  Filter filter;
+  ThreadPool* pool; ///< If set, strips of rows are compressed on its
+                    ///workers as well as the calling thread
+};
+
+/** An image, consisting of a rectangle of elements stored as T, which
+ * is one of double, float, Half or Unorm8.
  * This class makes it easy to read PNG files and the like from
  * files.
  * Note that colours in the range [0.0, 1.0] are mapped to the integer
  * range [0, 255] when writing and reading PNG files.
  */
-class Image {
+template<typename T>
+class BasicImage {
 public:
-  Image(); ///< Construct an empty image
-  Image(int width, int height, int depth); ///< Construct a black
+  typedef T Channel;
+
+  BasicImage(); ///< Construct an empty image
+  BasicImage(int width, int height, int depth); ///< Construct a black
                                              ///image at the given width/height/depth
-  Image(const Image& other); ///< Copy an image
+  BasicImage(const BasicImage& other); ///< Copy an image
+  BasicImage(BasicImage&& other); ///< Take the data of another image,
+                                  ///leaving it empty
+  template<typename U>
+  explicit BasicImage(const BasicImage<U>& other); ///< Copy an image
+                                                   ///stored as another type
 
-  ~Image();
+  ~BasicImage();
 
-  Image& operator=(const Image& other); ///< Copy the data from
+  BasicImage& operator=(const BasicImage& other); ///< Copy the data from
                                             ///one image to another
+  BasicImage& operator=(BasicImage&& other); ///< Take the data of
+                                             ///another image
 
-  int width() const; ///< Determine the width of the image
-  int height() const; ///< Determine the height of the image
-  int elements() const; ///< Determine the depth (doubles per pixel) of
+  int width() const { return m_width; } ///< Determine the width of the image
+  int height() const { return m_height; } ///< Determine the height of the image
+  int elements() const { return m_elements; } ///< Determine the depth (channels per pixel) of
                         ///the image
 
-  double operator()(int x, int y, int i) const; ///< Retrieve a
-                                               ///particular component
-                                               ///from the image.
-  double& operator()(int x, int y, int i);  ///< Retrieve a
-                                               ///particular component
-                                               ///from the image.
-
+  T operator()(int x, int y, int i) const ///< Retrieve a
+                                          ///particular component
+                                          ///from the image.
+  {
+    return m_data[m_elements * ((size_t)m_width * y + x) + i];
+  }
+  T& operator()(int x, int y, int i) ///< Retrieve a
+                                     ///particular component
+                                     ///from the image.
+  {
+    return m_data[m_elements * ((size_t)m_width * y + x) + i];
+  }
 
   bool loadPng(const std::string& filename); ///< Load a PNG file into
                                              /// this image.
 
-  bool savePng(const std::string& filename); ///< Save this image into
-                                             ///  the given PNG file
-  
-  const double* data() const;
-  double* data();
-  
+  bool savePng(const std::string& filename,
+               const PngOptions& options = PngOptions()) const; ///< Save this image into
+                                                                ///  the given PNG file
+
+  const T* data() const { return m_data; }
+  T* data() { return m_data; }
+
+  /// Number of channels in the image. Computed in 64 bits so huge
+  /// images don't overflow
+  size_t size() const { return (size_t)m_width * m_height * m_elements; }
+
 private:
   int m_width, m_height;
   int m_elements;
-  double* m_data;
+  T* m_data; ///< Aligned to a cache line, see allocate()
+
+  static T* allocate(size_t n);
+  static void deallocate(T* p);
+};
+
+template<typename T>
+template<typename U>
+BasicImage<T>::BasicImage(const BasicImage<U>& other)
+  : m_width(other.width()), m_height(other.height()), m_elements(other.elements()),
+    m_data(other.data() ? allocate(size()) : 0)
+{
+  if (m_data) convert_channels(other.data(), m_data, size());
+}
+
+typedef BasicImage<float> Image; ///< What the renderer draws into
+typedef BasicImage<Half> HalfImage;
+typedef BasicImage<Unorm8> ByteImage;
+
+/** Writes a PNG file a band of rows at a time, so an image can be
+ * saved without ever holding the whole thing in memory. Each band is
+ * cut into strips that are filtered and deflated independently,
+ * optionally in parallel, and stitched back into one zlib stream.
+ */
+class PngWriter {
+public:
+  PngWriter();
+  ~PngWriter(); ///< Closes the file if it is still open
+
+  /// Create the file and write the PNG header for an image of the
+  /// given size and depth (1 to 4 elements per pixel).
+  bool open(const std::string& filename, int width, int height, int elements,
+            const PngOptions& options = PngOptions());
+
+  /// Append the first rows rows of band, which must have the width and
+  /// depth given to open().
+  template<typename T>
+  bool write_rows(const BasicImage<T>& band, int rows);
+
+  /// Finish the file. Every row must have been written.
+  bool close();
+
+  struct State; ///< The file and what carries over from one band to the next
+
+private:
+  State* m_state;
+
+  PngWriter(const PngWriter&);
+  PngWriter& operator=(const PngWriter&);
 };
 
 #endif
@@ -1,11 +1,54 @@
 #include <iostream>
+#include <cstdlib>
 #include "scene_lua.hpp"
+#include "threadpool.hpp"
+#include "meshcache.hpp"
+#include "cachefile.hpp"
+#include "bvh.hpp"
+
+static int usage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [-j threads] [-cache dir] [-nocache] [-binarybvh] [scene.lua]" << std::endl
+            << "       " << program << " -convert in.obj out.mesh" << std::endl;
+  return 1;
+}
 
 int main(int argc, char** argv)
 {
   std::string filename = "scene.lua";
-  if (argc >= 2) {
-    filename = argv[1];
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-j") {
+      // Number of render threads, defaults to one per hardware thread
+      if (i + 1 >= argc) return usage(argv[0]);
+      char* end;
+      long threads = std::strtol(argv[++i], &end, 10);
+      if (end == argv[i] || *end != '\0' || threads < 1 || threads > 4096) {
+        std::cerr << "Bad thread count " << argv[i] << std::endl;
+        return usage(argv[0]);
+      }
+      set_render_threads(static_cast<unsigned int>(threads));
+    } else if (arg == "-cache") {
+      // Where meshes and BVHs are cached, defaults to .rtcache
+      if (i + 1 >= argc) return usage(argv[0]);
+      set_cache_dir(argv[++i]);
+    } else if (arg == "-nocache") {
+      set_cache_dir("");
+    } else if (arg == "-binarybvh") {
+      // Trace through binary BVHs instead of collapsing them into 4-wide ones, for comparison
+      set_wide_bvh(false);
+    } else if (arg == "-convert") {
+      // Convert an OBJ file to a mesh file and exit
+      if (i + 2 >= argc) return usage(argv[0]);
+      std::string error;
+      if (!convert_obj(argv[i + 1], argv[i + 2], error, &render_pool())) {
+        std::cerr << error << std::endl;
+        return 1;
+      }
+      return 0;
+    } else {
+      filename = arg;
+    }
   }
 
   if (!run_lua(filename)) {
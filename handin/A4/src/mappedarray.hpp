@@ -0,0 +1,149 @@
+#ifndef CS488_MAPPEDARRAY_HPP
+#define CS488_MAPPEDARRAY_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Allocator for vectors of types that need stricter alignment than new gives them in C++11, such as BVH
+// nodes aligned to cache lines
+template<typename T>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  AlignedAllocator() {}
+  template<typename U>
+  AlignedAllocator(const AlignedAllocator<U>&) {}
+
+  T* allocate(size_t n)
+  {
+    void* p;
+    size_t alignment = (alignof(T) > sizeof(void*)) ? alignof(T) : sizeof(void*);
+    if(posix_memalign(&p, alignment, (n > 0 ? n : 1) * sizeof(T))) throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T* p, size_t)
+  {
+    free(p);
+  }
+};
+
+template<typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+  return true;
+}
+template<typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&)
+{
+  return false;
+}
+
+// A read only array that either holds its own elements or refers to elements someone else owns, usually a
+// section of a memory mapped cache file. Meshes and BVHs keep their arrays in these so the same code can
+// trace through a structure that was just built or one that was loaded from disk without copying it.
+// Allocator is what the elements it owns are allocated with
+template<typename T, typename Allocator = std::allocator<T> >
+class MappedArray {
+public:
+  MappedArray()
+    : m_data(NULL)
+    , m_size(0)
+  {}
+
+  // Takes over the elements of owned
+  MappedArray(std::vector<T, Allocator>&& owned)
+    : m_owned(std::move(owned))
+    , m_data(m_owned.data())
+    , m_size(m_owned.size())
+  {}
+
+  // Refers to size elements at data, which have to outlive the array
+  MappedArray(const T* data, size_t size)
+    : m_data(data)
+    , m_size(size)
+  {}
+
+  MappedArray(const MappedArray& other)
+    : m_owned(other.m_owned)
+    , m_data(other.owned() ? m_owned.data() : other.m_data)
+    , m_size(other.m_size)
+  {}
+
+  MappedArray(MappedArray&& other)
+    : m_data(NULL)
+    , m_size(0)
+  {
+    *this = std::move(other);
+  }
+
+  MappedArray& operator=(const MappedArray& other)
+  {
+    if(this != &other)
+    {
+      m_owned = other.m_owned;
+      m_data = other.owned() ? m_owned.data() : other.m_data;
+      m_size = other.m_size;
+    }
+    return *this;
+  }
+
+  MappedArray& operator=(MappedArray&& other)
+  {
+    if(this != &other)
+    {
+      bool owned = other.owned();
+      m_owned = std::move(other.m_owned);
+      m_data = owned ? m_owned.data() : other.m_data;
+      m_size = other.m_size;
+      other.m_owned.clear();
+      other.m_data = NULL;
+      other.m_size = 0;
+    }
+    return *this;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+  bool empty() const
+  {
+    return m_size == 0;
+  }
+
+  const T& operator[](size_t i) const
+  {
+    return m_data[i];
+  }
+
+  const T* data() const
+  {
+    return m_data;
+  }
+
+  const T* begin() const
+  {
+    return m_data;
+  }
+
+  const T* end() const
+  {
+    return m_data + m_size;
+  }
+
+private:
+  std::vector<T, Allocator> m_owned;
+  const T* m_data;
+  size_t m_size;
+
+  bool owned() const
+  {
+    return !m_owned.empty();
+  }
+};
+
+#endif
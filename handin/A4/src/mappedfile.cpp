@@ -0,0 +1,58 @@
+#include "mappedfile.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile()
+  : m_data(NULL)
+  , m_size(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+bool MappedFile::open(const std::string& filename)
+{
+  close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    ::close(fd);
+    return false;
+  }
+
+  // Empty files can't be mapped but are perfectly good files
+  if(st.st_size > 0)
+  {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED)
+    {
+      ::close(fd);
+      return false;
+    }
+
+    // Readers go through the whole file, usually from several threads at once, so ask for all of it up front
+    madvise(p, st.st_size, MADV_WILLNEED);
+    m_data = static_cast<const char*>(p);
+    m_size = st.st_size;
+  }
+
+  // The mapping keeps the file open
+  ::close(fd);
+  return true;
+}
+
+void MappedFile::close()
+{
+  if(m_data) munmap(const_cast<char*>(m_data), m_size);
+  m_data = NULL;
+  m_size = 0;
+}
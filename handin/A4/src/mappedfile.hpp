@@ -0,0 +1,36 @@
+#ifndef CS488_MAPPEDFILE_HPP
+#define CS488_MAPPEDFILE_HPP
+
+#include <string>
+#include <cstddef>
+
+// A whole file mapped read only into memory, so it can be read without copying it into buffers first.
+// The mapping lasts until close() or the MappedFile is destroyed.
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+
+  // Maps filename, unmapping whatever was mapped before. Returns false if it can't be opened
+  bool open(const std::string& filename);
+  void close();
+
+  const char* data() const
+  {
+    return m_data;
+  }
+
+  size_t size() const
+  {
+    return m_size;
+  }
+
+private:
+  const char* m_data;
+  size_t m_size;
+
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+};
+
+#endif
@@ -5,7 +5,7 @@ Material::~Material()
 }
 
 PhongMaterial::PhongMaterial(const Colour& kd, const Colour& ks, double shininess)
-  : m_kd(kd), m_ks(ks), m_shininess(shininess)
+  : Material(PHONG), m_kd(kd), m_ks(ks), m_shininess(shininess)
 {
 }
 
@@ -13,3 +13,30 @@ PhongMaterial::~PhongMaterial()
 {
 }
 
+
+unsigned int MaterialTable::add(const Material* material)
+{
+  auto it = m_indices.find(material);
+  if(it != m_indices.end()) return it->second;
+
+  MaterialData data = {Material::PHONG, Colour(0.5), Colour(0.0), 1.0};
+  if(material != NULL)
+  {
+    switch(material->type())
+    {
+    case Material::PHONG:
+      {
+        const PhongMaterial* phong = static_cast<const PhongMaterial*>(material);
+        data.kd = phong->diffuse();
+        data.ks = phong->specular();
+        data.shininess = phong->shininess();
+      }
+      break;
+    }
+  }
+
+  unsigned int index = m_materials.size();
+  m_materials.push_back(data);
+  m_indices[material] = index;
+  return index;
+}
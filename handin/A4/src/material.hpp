@@ -1,16 +1,32 @@
 #ifndef CS488_MATERIAL_HPP
 #define CS488_MATERIAL_HPP
 
+#include <vector>
+#include <map>
 #include "algebra.hpp"
 
 class Material {
 public:
+  // Tag for each kind of material so the renderer can switch on it instead of casting
+  enum Type {
+    PHONG
+  };
+
   virtual ~Material();
 
+  Type type() const
+  {
+    return m_type;
+  }
+
 protected:
-  Material()
+  Material(Type type)
+    : m_type(type)
   {
   }
+
+private:
+  Type m_type;
 };
 
 class PhongMaterial : public Material {
@@ -38,5 +54,35 @@ private:
   double m_shininess;
 };
 
+// Plain copy of a material's parameters for the shading code. Which fields are used depends on type
+struct MaterialData {
+  Material::Type type;
+  Colour kd;
+  Colour ks;
+  double shininess;
+};
+
+// Every material in a scene copied into one array. Hits refer to their material by its index in the table
+class MaterialTable {
+public:
+  // Index of the material, adding it to the table the first time it is seen. Geometry without a material
+  // gets a plain grey one
+  unsigned int add(const Material* material);
+
+  const MaterialData& operator[](unsigned int index) const
+  {
+    return m_materials[index];
+  }
+
+  size_t size() const
+  {
+    return m_materials.size();
+  }
+
+private:
+  std::vector<MaterialData> m_materials;
+  std::map<const Material*, unsigned int> m_indices;
+};
+
 
 #endif
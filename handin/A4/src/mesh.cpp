@@ -5,121 +5,217 @@
 
 Mesh::Mesh(const std::vector<Point3D>& verts,
            const std::vector< std::vector<int> >& faces)
-  : m_verts(verts)
-  , m_faces(faces)
-  , m_boundingBall(getBoundingBall(verts))
+  : m_verts(std::vector<GeomPoint3D>(verts.begin(), verts.end()))
+  , m_indices(triangulate(faces, verts.size()))
 {
+  build(true);
 }
 
-NonhierSphere Mesh::getBoundingBall(const std::vector<Point3D>& verts) const
+Mesh::Mesh(std::vector<GeomPoint3D>&& verts, std::vector<unsigned int>&& indices)
+  : m_verts(std::move(verts))
+  , m_indices(std::move(indices))
 {
-  Point3D C = verts[0] + 0.5*(verts[1]-verts[0]);
-  double radius = (verts[1] - verts[0]).length() / 2.0;
-
-  // This is the bouncing ball algorithm. Take any two points and construct the sphere's center
-  // at the center point of the line between the two vertices and raidus half the distance
-  // between the two vertices
-  // Then loop through each vertex. If it is outside the sphere then move the sphere's center
-  // a little bit towards the point while growing the radius as well so that the point is now inside 
-  // the sphere. Keep doing this until there are no vertices outside the sphere
-  for(bool outsider = true; outsider == true;)
-  {
-    outsider = false;
-    for(auto v : verts)
+  // These come from OBJ files, which load_obj_mesh() caches whole, BVH included
+  build(false);
+}
+
+std::vector<unsigned int> Mesh::triangulate(const std::vector< std::vector<int> >& faces, size_t vert_count)
+{
+  // Faces with fewer than three vertices or with a vertex that doesn't exist can't be triangulated and are
+  // dropped, so everything in the flat index array is safe to look up
+  auto valid = [vert_count](const std::vector<int>& face) {
+    if(face.size() < 3) return false;
+    for(int index : face)
     {
-      double length = (v-C).length();
-      if(length > radius)
-      {
-        double diff = length - radius;
-        double delta = diff / length;
-        C = C + (0.5 * delta)*(v-C);
-        radius = radius + (0.5 * diff);
-        outsider = true;
-      }
+      if(index < 0 || size_t(index) >= vert_count) return false;
     }
+    return true;
+  };
+
+  size_t count = 0, skipped = 0;
+  for(const auto& face : faces)
+  {
+    if(valid(face)) count += face.size() - 2;
+    else skipped++;
   }
+  if(skipped > 0) std::cerr << "Mesh: skipped " << skipped << " degenerate or out of range faces" << std::endl;
 
-  return NonhierSphere(C, radius);
+  std::vector<unsigned int> indices;
+  indices.reserve(3*count);
+
+  // Faces are convex so each one can be split into a fan of triangles around its first vertex
+  for(const auto& face : faces)
+  {
+    if(!valid(face)) continue;
+    for(size_t i = 2; i < face.size(); i++)
+    {
+      indices.push_back(face[0]);
+      indices.push_back(face[i-1]);
+      indices.push_back(face[i]);
+    }
+  }
+  return indices;
 }
 
-bool Mesh::intersect(const Ray& ray, Intersection& j) const
+void Mesh::build(bool cache_bvh)
 {
-  bool intersected = false;
+  std::vector<Triangle> triangles;
+  std::vector<BoundingBox> bounds;
+  triangles.reserve(m_indices.size() / 3);
+  bounds.reserve(m_indices.size() / 3);
 
-  // Check if bounding ball has been intersected first
-  // If not then the mesh cannot have been intersected
-  Intersection k;
-  bool bball_intersected = m_boundingBall.intersect(ray, k);
-  if(bball_intersected)
+  for(size_t i = 0; i < m_indices.size(); i += 3)
   {
-    // Loop through each face and check if there is an intersection
-    double prev_t = std::numeric_limits<double>::infinity();
-    for(auto face : m_faces)
+    // Worked out in double from the stored vertices, so with float geometry neighbouring triangles still
+    // share exactly the same corners
+    Point3D P0(m_verts[m_indices[i]]);
+    Point3D P1(m_verts[m_indices[i+1]]);
+    Point3D P2(m_verts[m_indices[i+2]]);
+    Vector3D e1 = P1 - P0;
+    Vector3D e2 = P2 - P0;
+    Vector3D n = e1.cross(e2);
+
+    // Degenerate triangles keep a zero normal, which the ray/plane test in intersect_triangle always rejects
+    Triangle tri;
+    tri.p0 = GeomPoint3D(P0);
+    double n2 = n.length2();
+    if(n2 > 0.0)
     {
-      // Compute the normal for the face
-      Point3D P0 = m_verts[face[0]];
-      Point3D P1 = m_verts[face[1]];
-      Point3D P2 = m_verts[face[2]];
-
-      Vector3D n = (P1-P0).cross(P2-P0).normalized();
-
-      // Now check if the ray intersects the polygon containing the face
-      // If denom is 0 then the ray does not intersect the plane at all
-      double denom = n.dot(ray.direction());
-      if(fabs(denom) < std::numeric_limits<double>::epsilon()) continue;
-
-      // If t is negative or a previous intersection has a smaller t (meaning it is closer to the
-      // ray's origin) then disregard this face and continue
-      double t = n.dot(P0 - ray.origin()) / denom;
-      if(t < 0 || prev_t < t) continue;
-
-      // Calculate intersection point
-      Point3D Q = ray.origin() + t*ray.direction();
-
-      bool outside = false;
-      for(size_t i = 0; i < face.size(); i++)
-      {
-        Point3D Q0 = (i == 0) ? m_verts[face.back()] : m_verts[face[i-1]];
-        Point3D Q1 = m_verts[face[i]];
-
-        if((Q1-Q0).cross(Q-Q0).dot(n) < 0)
-        {
-          outside = true;
-          break;
-        }
-      }
-
-      if(!outside)
-      {
-        // It is within the bounds of the polygon
-        intersected = true;
-        prev_t = t;
-        j.q = Q;
-        j.n = n;
-      }
+      tri.n = GeomVector3D((1.0 / sqrt(n2)) * n);
+      tri.ubasis = GeomVector3D((1.0 / n2) * e2.cross(n));
+      tri.vbasis = GeomVector3D((1.0 / n2) * n.cross(e1));
     }
+    triangles.push_back(tri);
+
+    BoundingBox b;
+    b.extend(P0);
+    b.extend(P1);
+    b.extend(P2);
+    bounds.push_back(b);
   }
 
+  m_triangles = MappedArray<Triangle>(std::move(triangles));
+  if(cache_bvh) m_bvh.build_cached(bounds);
+  else m_bvh.build(bounds);
+}
+
+bool Mesh::intersect_triangle(const Triangle& tri, const Ray& ray, double& tmax, double& u, double& v) const
+{
+  // Check if the ray intersects the plane containing the triangle
+  // If denom is 0 then the ray does not intersect the plane at all
+  Vector3D n(tri.n);
+  double denom = n.dot(ray.direction());
+  if(fabs(denom) < std::numeric_limits<double>::epsilon()) return false;
+
+  // If t is before the start of the ray or a previous intersection has a smaller t (meaning it is closer
+  // to the ray's origin) then disregard this triangle
+  Vector3D to_p0 = Point3D(tri.p0) - ray.origin();
+  double t = n.dot(to_p0) / denom;
+  if(t < ray.tmin() || tmax < t) return false;
+
+  // The intersection point is inside the triangle if both its barycentric coordinates and their sum are in [0, 1]
+  Vector3D p = t*ray.direction() - to_p0;
+  double a = p.dot(Vector3D(tri.ubasis));
+  if(a < 0.0 || a > 1.0) return false;
+  double b = p.dot(Vector3D(tri.vbasis));
+  if(b < 0.0 || a + b > 1.0) return false;
+
+  tmax = t;
+  u = a;
+  v = b;
+  return true;
+}
+
+unsigned int Mesh::intersect_triangle(const Triangle& tri, RayPacket& packet) const
+{
+  DVec nx(tri.n[0]), ny(tri.n[1]), nz(tri.n[2]);
+  DVec ux(tri.ubasis[0]), uy(tri.ubasis[1]), uz(tri.ubasis[2]);
+  DVec vx(tri.vbasis[0]), vy(tri.vbasis[1]), vz(tri.vbasis[2]);
+
+  unsigned int mask = 0;
+  for(int k = 0; k < RayPacket::SIZE; k += DVec::WIDTH)
+  {
+    DVec dx = DVec::load(packet.d[0] + k), dy = DVec::load(packet.d[1] + k), dz = DVec::load(packet.d[2] + k);
+    DVec px = DVec(tri.p0[0]) - DVec::load(packet.o[0] + k);
+    DVec py = DVec(tri.p0[1]) - DVec::load(packet.o[1] + k);
+    DVec pz = DVec(tri.p0[2]) - DVec::load(packet.o[2] + k);
+
+    // Same plane and barycentric tests as the single ray version. Lanes where denom is 0 produce infinities or
+    // NaNs in t, which are masked out with everything else that misses
+    DVec denom = nx*dx + ny*dy + nz*dz;
+    DVec t = (nx*px + ny*py + nz*pz) / denom;
+    px = t*dx - px;
+    py = t*dy - py;
+    pz = t*dz - pz;
+    DVec u = px*ux + py*uy + pz*uz;
+    DVec v = px*vx + py*vy + pz*vz;
+
+    DVec tmax = DVec::load(packet.t + k);
+    DVec hit = (abs(denom) >= DVec(std::numeric_limits<double>::epsilon())) & (t >= DVec(0.0)) & (t < tmax)
+             & (u >= DVec(0.0)) & (v >= DVec(0.0)) & (u + v <= DVec(1.0));
+    select(hit, t, tmax).store(packet.t + k);
+    mask |= bits(hit) << k;
+  }
+  return mask;
+}
+
+unsigned int Mesh::intersect_packet(RayPacket& packet) const
+{
+  unsigned int mask = 0;
+  m_bvh.intersect(packet, [&](unsigned int index) {
+    mask |= intersect_triangle(m_triangles[index], packet);
+  });
+  return mask;
+}
+
+bool Mesh::intersect(const Ray& ray, Intersection& j) const
+{
+  // The BVH only visits triangles whose bounds the ray passes through, nearest first, and stops
+  // looking once the remaining triangles are all further away than the closest hit
+  double tmax = std::min(ray.tmax(), j.t);
+  bool intersected = m_bvh.intersect(ray, tmax, [&](unsigned int index, double& t) {
+    if(!intersect_triangle(m_triangles[index], ray, t, j.u, j.v)) return false;
+    j.primitive = index;
+    return true;
+  });
+
+  if(intersected) j.t = tmax;
+
   return intersected;
 }
 
+Vector3D Mesh::get_normal(const Ray&, const Intersection& j) const
+{
+  return Vector3D(m_triangles[j.primitive].n);
+}
+
+bool Mesh::occluded(const Ray& ray) const
+{
+  return m_bvh.occluded(ray, [&](unsigned int index) {
+    double t = ray.tmax(), u, v;
+    return intersect_triangle(m_triangles[index], ray, t, u, v);
+  });
+}
+
+BoundingBox Mesh::get_bounds() const
+{
+  BoundingBox b;
+  for(const auto& v : m_verts) b.extend(Point3D(v));
+  return b;
+}
+
 std::ostream& operator<<(std::ostream& out, const Mesh& mesh)
 {
   std::cerr << "mesh({";
-  for (std::vector<Point3D>::const_iterator I = mesh.m_verts.begin(); I != mesh.m_verts.end(); ++I) {
+  for (const GeomPoint3D* I = mesh.m_verts.begin(); I != mesh.m_verts.end(); ++I) {
     if (I != mesh.m_verts.begin()) std::cerr << ",\n      ";
     std::cerr << *I;
   }
   std::cerr << "},\n\n     {";
   
-  for (std::vector<Mesh::Face>::const_iterator I = mesh.m_faces.begin(); I != mesh.m_faces.end(); ++I) {
-    if (I != mesh.m_faces.begin()) std::cerr << ",\n      ";
-    std::cerr << "[";
-    for (Mesh::Face::const_iterator J = I->begin(); J != I->end(); ++J) {
-      if (J != I->begin()) std::cerr << ", ";
-      std::cerr << *J;
-    }
-    std::cerr << "]";
+  for (size_t i = 0; i < mesh.m_indices.size(); i += 3) {
+    if (i != 0) std::cerr << ",\n      ";
+    std::cerr << "[" << mesh.m_indices[i] << ", " << mesh.m_indices[i+1] << ", " << mesh.m_indices[i+2] << "]";
   }
   std::cerr << "});" << std::endl;
   return out;
@@ -3,27 +3,75 @@
 
 #include <vector>
 #include <iosfwd>
+#include <memory>
+#include <string>
 #include "primitive.hpp"
 #include "algebra.hpp"
+#include "bvh.hpp"
+#include "mappedarray.hpp"
+
+class MappedFile;
 
 // A polygonal mesh.
+// Polygons are split into triangle fans when the mesh is built and everything the intersection
+// test needs is stored in flat arrays indexed by triangle, so nothing is recomputed per ray
 class Mesh : public Primitive {
 public:
   Mesh(const std::vector<Point3D>& verts,
        const std::vector< std::vector<int> >& faces);
-
-  typedef std::vector<int> Face;
+  // Takes over arrays that are already split into triangles, three vertex indices per triangle, like the ones
+  // read_obj() returns
+  Mesh(std::vector<GeomPoint3D>&& verts, std::vector<unsigned int>&& indices);
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
-  
+  virtual Vector3D get_normal(const Ray& ray, const Intersection& j) const;
+  virtual bool occluded(const Ray& ray) const;
+  virtual unsigned int intersect_packet(RayPacket& packet) const;
+  virtual BoundingBox get_bounds() const;
+
+  size_t vertex_count() const
+  {
+    return m_verts.size();
+  }
+  size_t triangle_count() const
+  {
+    return m_triangles.size();
+  }
+  const BVH& bvh() const
+  {
+    return m_bvh;
+  }
+
+  // Everything needed to intersect a ray with a triangle. Stored in GeomReal precision, the tests
+  // themselves are always done in double
+  struct Triangle {
+    GeomPoint3D p0; // First vertex
+    GeomVector3D n; // Unit normal
+    // Dotting these with (Q - p0) for a point Q on the triangle's plane gives Q's barycentric
+    // coordinates along the edges p1-p0 and p2-p0
+    GeomVector3D ubasis, vbasis;
+  };
+
 private:
-  std::vector<Point3D> m_verts;
-  std::vector<Face> m_faces;
-  NonhierSphere m_boundingBall;
+  // These either hold the mesh or, for a mesh loaded from a cache file, point into the file, which m_file keeps
+  // mapped for as long as the mesh is around
+  MappedArray<GeomPoint3D> m_verts;
+  MappedArray<unsigned int> m_indices; // Three vertex indices per triangle
+  MappedArray<Triangle> m_triangles;
+  std::shared_ptr<const MappedFile> m_file;
+
+  // BVH over the triangles so a ray only has to be tested against the triangles near it
+  BVH m_bvh;
 
-  NonhierSphere getBoundingBall(const std::vector<Point3D>& verts) const;
+  Mesh() {}
+  static std::vector<unsigned int> triangulate(const std::vector< std::vector<int> >& faces, size_t vert_count);
+  void build(bool cache_bvh);
+  bool intersect_triangle(const Triangle& tri, const Ray& ray, double& tmax, double& u, double& v) const;
+  unsigned int intersect_triangle(const Triangle& tri, RayPacket& packet) const;
 
   friend std::ostream& operator<<(std::ostream& out, const Mesh& mesh);
+  friend bool save_mesh(const Mesh& mesh, const std::string& filename, unsigned long long key, std::string& error);
+  friend Mesh* load_mesh(const std::string& filename, unsigned long long key, std::string& error);
 };
 
 #endif
@@ -0,0 +1,154 @@
+#include "meshcache.hpp"
+#include "mesh.hpp"
+#include "mappedfile.hpp"
+#include "cachefile.hpp"
+#include "objfile.hpp"
+#include <iostream>
+
+static const char MESH_FILE_MAGIC[8] = {'C', 'S', '4', '8', '8', 'M', 'S', 'H'};
+// Bumped whenever the layout of the file or of anything stored in it changes
+static const unsigned int MESH_FILE_VERSION = 3;
+
+enum {
+  SECTION_VERTS,
+  SECTION_INDICES, // Three vertex indices per triangle
+  SECTION_TRIANGLES, // Mesh::Triangle, the precomputed planes and barycentric bases
+  SECTION_NODES, // BVH::Node, if the BVH is binary
+  SECTION_WIDE_NODES, // BVH::WideNode, if it is wide
+  SECTION_LEAF_INDICES, // Triangle indices the BVH's leaves refer to
+  SECTION_COUNT
+};
+
+// The sections of a mesh file with nothing in them yet
+static std::vector<CacheSection> mesh_sections()
+{
+  std::vector<CacheSection> sections(SECTION_COUNT);
+  sections[SECTION_VERTS].element_size = sizeof(GeomPoint3D);
+  sections[SECTION_INDICES].element_size = sizeof(unsigned int);
+  sections[SECTION_TRIANGLES].element_size = sizeof(Mesh::Triangle);
+  sections[SECTION_NODES].element_size = sizeof(BVH::Node);
+  sections[SECTION_WIDE_NODES].element_size = sizeof(BVH::WideNode);
+  sections[SECTION_LEAF_INDICES].element_size = sizeof(unsigned int);
+  return sections;
+}
+
+template<typename T, typename Allocator = std::allocator<T> >
+static MappedArray<T, Allocator> section_array(const CacheSection& section)
+{
+  return MappedArray<T, Allocator>(static_cast<const T*>(section.data), section.count);
+}
+
+bool save_mesh(const Mesh& mesh, const std::string& filename, unsigned long long key, std::string& error)
+{
+  std::vector<CacheSection> sections = mesh_sections();
+  sections[SECTION_VERTS].data = mesh.m_verts.data();
+  sections[SECTION_VERTS].count = mesh.m_verts.size();
+  sections[SECTION_INDICES].data = mesh.m_indices.data();
+  sections[SECTION_INDICES].count = mesh.m_indices.size();
+  sections[SECTION_TRIANGLES].data = mesh.m_triangles.data();
+  sections[SECTION_TRIANGLES].count = mesh.m_triangles.size();
+  sections[SECTION_NODES].data = mesh.m_bvh.nodes().data();
+  sections[SECTION_NODES].count = mesh.m_bvh.nodes().size();
+  sections[SECTION_WIDE_NODES].data = mesh.m_bvh.wide_nodes().data();
+  sections[SECTION_WIDE_NODES].count = mesh.m_bvh.wide_nodes().size();
+  sections[SECTION_LEAF_INDICES].data = mesh.m_bvh.indices().data();
+  sections[SECTION_LEAF_INDICES].count = mesh.m_bvh.indices().size();
+
+  return write_cache_file(filename, MESH_FILE_MAGIC, MESH_FILE_VERSION, key, sections, error);
+}
+
+Mesh* load_mesh(const std::string& filename, unsigned long long key, std::string& error)
+{
+  std::vector<CacheSection> sections = mesh_sections();
+  std::shared_ptr<const MappedFile> file = read_cache_file(filename, MESH_FILE_MAGIC, MESH_FILE_VERSION, key, sections, error);
+  if(!file) return NULL;
+
+  // Check every vertex index so a damaged file can't send the tracer off the end of the vertex array. The
+  // BVH checks its own
+  size_t vert_count = sections[SECTION_VERTS].count;
+  size_t triangle_count = sections[SECTION_TRIANGLES].count;
+  const unsigned int* indices = static_cast<const unsigned int*>(sections[SECTION_INDICES].data);
+  bool valid = sections[SECTION_INDICES].count == 3 * triangle_count;
+  for(size_t i = 0; valid && i < 3 * triangle_count; i++) valid = indices[i] < vert_count;
+
+  Mesh* mesh = new Mesh();
+  if(!valid || !mesh->m_bvh.assign(section_array<BVH::Node>(sections[SECTION_NODES]),
+                                   section_array<BVH::WideNode, AlignedAllocator<BVH::WideNode> >(sections[SECTION_WIDE_NODES]),
+                                   section_array<unsigned int>(sections[SECTION_LEAF_INDICES]), triangle_count))
+  {
+    delete mesh;
+    error = filename + " is corrupt";
+    return NULL;
+  }
+  mesh->m_verts = section_array<GeomPoint3D>(sections[SECTION_VERTS]);
+  mesh->m_indices = section_array<unsigned int>(sections[SECTION_INDICES]);
+  mesh->m_triangles = section_array<Mesh::Triangle>(sections[SECTION_TRIANGLES]);
+  mesh->m_file = file;
+  return mesh;
+}
+
+static bool hash_file(const std::string& filename, unsigned long long& key, std::string& error)
+{
+  MappedFile file;
+  if(!file.open(filename))
+  {
+    error = "Couldn't open " + filename;
+    return false;
+  }
+  key = hash_words(file.data(), file.size());
+  return true;
+}
+
+Mesh* load_obj_mesh(const std::string& filename, std::string& error, ThreadPool* pool)
+{
+  const std::string extension = ".mesh";
+  if(filename.size() > extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0)
+  {
+    return load_mesh(filename, 0, error);
+  }
+
+  std::string cache;
+  unsigned long long key = 0;
+  if(!cache_dir().empty())
+  {
+    if(!hash_file(filename, key, error)) return NULL;
+    cache = cache_path(key, ".mesh");
+
+    // Anything wrong with the cached copy just means reading the OBJ file again, and so does a copy whose BVH
+    // is in the other layout
+    std::string ignored;
+    Mesh* mesh = load_mesh(cache, key, ignored);
+    if(mesh && (mesh->bvh().wide() == wide_bvh() || mesh->triangle_count() == 0)) return mesh;
+    delete mesh;
+  }
+
+  std::vector<GeomPoint3D> verts;
+  std::vector<unsigned int> indices;
+  if(!read_obj(filename, verts, indices, error, pool)) return NULL;
+  Mesh* mesh = new Mesh(std::move(verts), std::move(indices));
+
+  if(!cache.empty())
+  {
+    std::string save_error;
+    if(!save_mesh(*mesh, cache, key, save_error))
+    {
+      std::cerr << "Couldn't cache " << filename << ": " << save_error << std::endl;
+    }
+  }
+
+  return mesh;
+}
+
+bool convert_obj(const std::string& obj_filename, const std::string& mesh_filename, std::string& error,
+                 ThreadPool* pool)
+{
+  unsigned long long key;
+  if(!hash_file(obj_filename, key, error)) return false;
+
+  std::vector<GeomPoint3D> verts;
+  std::vector<unsigned int> indices;
+  if(!read_obj(obj_filename, verts, indices, error, pool)) return false;
+
+  Mesh mesh(std::move(verts), std::move(indices));
+  return save_mesh(mesh, mesh_filename, key, error);
+}
@@ -0,0 +1,34 @@
+#ifndef CS488_MESHCACHE_HPP
+#define CS488_MESHCACHE_HPP
+
+#include <string>
+#include <cstddef>
+
+class Mesh;
+class ThreadPool;
+
+// Binary mesh files. A mesh file is a cache file (see cachefile.hpp) holding everything a Mesh needs to trace
+// rays: vertices, triangle indices, the precomputed triangle planes and the BVH. Loading one is a matter of
+// mapping it and pointing the mesh's arrays at its sections.
+
+// Writes mesh to filename. key identifies what the mesh was made from (see load_mesh()), 0 for nothing.
+// Returns false with a message in error if the file can't be written
+bool save_mesh(const Mesh& mesh, const std::string& filename, unsigned long long key, std::string& error);
+
+// Maps a mesh file written by save_mesh(). If key isn't 0 the file has to have been saved with the same key.
+// Returns NULL with a message in error if the file is missing, was written by an incompatible build or is
+// corrupt
+Mesh* load_mesh(const std::string& filename, unsigned long long key, std::string& error);
+
+// Loads an OBJ file through the cache: the first time a file is read its mesh is saved in the cache
+// directory under the hash of the file's contents, and later loads of the same contents map that instead of
+// parsing the file and rebuilding the BVH. Files ending in .mesh are loaded with load_mesh() directly.
+// Returns NULL with a message in error if the file can't be read
+Mesh* load_obj_mesh(const std::string& filename, std::string& error, ThreadPool* pool = NULL);
+
+// Reads an OBJ file and writes it out as a mesh file that gr.objmesh can load directly, keyed on the OBJ
+// file's hash. Returns false with a message in error if either file can't be read or written
+bool convert_obj(const std::string& obj_filename, const std::string& mesh_filename, std::string& error,
+                 ThreadPool* pool = NULL);
+
+#endif
@@ -0,0 +1,315 @@
+#include "objfile.hpp"
+#include "mappedfile.hpp"
+#include "threadpool.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <sstream>
+#include <algorithm>
+
+// Files are cut into chunks of about this many bytes, each parsed as one task
+static const size_t CHUNK_SIZE = 1 << 20;
+
+// The vertices and triangles from one chunk of the file. Positive face indices are absolute, but negative
+// ones count back from the last vertex read, so until the chunks before have been parsed they can only be
+// worked out relative to the start of the chunk. Those are recorded in relative to be fixed up later
+struct ObjChunk {
+  std::vector<GeomPoint3D> verts;
+  std::vector<long long> indices;
+  std::vector<size_t> relative;
+  size_t lines;
+  size_t error_line; // Line in the chunk of the first error, if there was one
+  std::string error;
+};
+
+static bool is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static bool is_digit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+static const char* skip_space(const char* p, const char* end)
+{
+  while(p < end && is_space(*p)) p++;
+  return p;
+}
+
+// Parses a decimal number like strtod() would. Anything with at most 15 significant digits and a power of
+// ten exponent of at most 22, which covers everything exporters write, is converted exactly with a single
+// multiply or divide. Longer numbers are left to strtod()
+static bool parse_double(const char*& p, const char* end, double& value)
+{
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  const char* start = p;
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+  unsigned long long mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool any = false, exact = true;
+  for(; p < end && is_digit(*p); p++)
+  {
+    any = true;
+    if(digits < 18)
+    {
+      mantissa = 10 * mantissa + (*p - '0');
+      if(mantissa) digits++;
+    }
+    else
+    {
+      exact = false;
+      exponent++;
+    }
+  }
+  if(p < end && *p == '.')
+  {
+    for(p++; p < end && is_digit(*p); p++)
+    {
+      any = true;
+      if(digits < 18)
+      {
+        mantissa = 10 * mantissa + (*p - '0');
+        if(mantissa) digits++;
+        exponent--;
+      }
+      else
+      {
+        exact = false;
+      }
+    }
+  }
+  if(!any)
+  {
+    p = start;
+    return false;
+  }
+
+  if(p + 1 < end && (*p == 'e' || *p == 'E'))
+  {
+    const char* q = p + 1;
+    bool negative_exponent = false;
+    if(*q == '-' || *q == '+') negative_exponent = *q++ == '-';
+    if(q < end && is_digit(*q))
+    {
+      int e = 0;
+      for(; q < end && is_digit(*q); q++) e = std::min(10 * e + (*q - '0'), 100000);
+      exponent += negative_exponent ? -e : e;
+      p = q;
+    }
+  }
+
+  if(exact && digits <= 15 && exponent >= -22 && exponent <= 22)
+  {
+    value = (exponent < 0) ? mantissa / powers[-exponent] : mantissa * powers[exponent];
+    if(negative) value = -value;
+    return true;
+  }
+
+  // The number might run right up to the end of the mapping, so strtod() gets a terminated copy
+  char buffer[128];
+  size_t length = std::min<size_t>(p - start, sizeof(buffer) - 1);
+  std::memcpy(buffer, start, length);
+  buffer[length] = '\0';
+  value = std::strtod(buffer, NULL);
+  return true;
+}
+
+static bool parse_int(const char*& p, const char* end, long long& value)
+{
+  const char* start = p;
+  bool negative = false;
+  if(p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+  if(p == end || !is_digit(*p))
+  {
+    p = start;
+    return false;
+  }
+
+  value = 0;
+  for(; p < end && is_digit(*p); p++) value = std::min(10 * value + (*p - '0'), (long long)INT_MAX + 1);
+  if(negative) value = -value;
+  return true;
+}
+
+// Parses the lines in [begin, end), which starts at the beginning of a line
+static void parse_chunk(const char* begin, const char* end, ObjChunk& chunk)
+{
+  chunk.lines = 0;
+
+  std::vector<long long> face;
+  std::vector<bool> face_relative;
+
+  for(const char* line = begin; line < end; )
+  {
+    const char* eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+    if(!eol) eol = end;
+    chunk.lines++;
+
+    const char* p = skip_space(line, eol);
+    bool vertex = p + 1 < eol && p[0] == 'v' && is_space(p[1]);
+    bool polygon = p + 1 < eol && p[0] == 'f' && is_space(p[1]);
+
+    if(vertex)
+    {
+      // x y z, possibly followed by a w or a colour that don't matter here
+      p += 2;
+      double v[3];
+      for(int i = 0; i < 3; i++)
+      {
+        p = skip_space(p, eol);
+        if(!parse_double(p, eol, v[i]))
+        {
+          chunk.error = "Expected three coordinates";
+          chunk.error_line = chunk.lines;
+          return;
+        }
+      }
+      chunk.verts.push_back(GeomPoint3D(v[0], v[1], v[2]));
+    }
+    else if(polygon)
+    {
+      // Each corner is v, v/vt, v//vn or v/vt/vn and only v is wanted
+      face.clear();
+      face_relative.clear();
+      p += 2;
+      for(;;)
+      {
+        p = skip_space(p, eol);
+        if(p == eol) break;
+
+        long long index;
+        if(!parse_int(p, eol, index) || index == 0)
+        {
+          chunk.error = "Invalid vertex index";
+          chunk.error_line = chunk.lines;
+          return;
+        }
+        while(p < eol && !is_space(*p)) p++;
+
+        face.push_back(index > 0 ? index - 1 : (long long)chunk.verts.size() + index);
+        face_relative.push_back(index < 0);
+      }
+
+      if(face.size() < 3)
+      {
+        chunk.error = "Face with fewer than three vertices";
+        chunk.error_line = chunk.lines;
+        return;
+      }
+
+      // Split into a fan around the first corner, the same as Mesh does with the faces it is given
+      for(size_t i = 2; i < face.size(); i++)
+      {
+        const size_t corners[3] = {0, i - 1, i};
+        for(size_t corner : corners)
+        {
+          if(face_relative[corner]) chunk.relative.push_back(chunk.indices.size());
+          chunk.indices.push_back(face[corner]);
+        }
+      }
+    }
+
+    line = eol + 1;
+  }
+}
+
+bool read_obj(const std::string& filename, std::vector<GeomPoint3D>& verts, std::vector<unsigned int>& indices,
+              std::string& error, ThreadPool* pool)
+{
+  MappedFile file;
+  if(!file.open(filename))
+  {
+    error = "Couldn't open " + filename;
+    return false;
+  }
+
+  // Cut the file after the first newline at or past every CHUNK_SIZE bytes
+  const char* data = file.data();
+  size_t size = file.size();
+  std::vector<const char*> starts(1, data);
+  for(size_t offset = CHUNK_SIZE; offset < size; offset += CHUNK_SIZE)
+  {
+    const char* p = std::max(starts.back(), data + offset - 1);
+    const char* eol = static_cast<const char*>(std::memchr(p, '\n', data + size - p));
+    if(!eol) break;
+    if(eol + 1 > starts.back()) starts.push_back(eol + 1);
+  }
+  starts.push_back(data + size);
+
+  size_t count = starts.size() - 1;
+  std::vector<ObjChunk> chunks(count);
+  auto parse = [&](size_t i) { parse_chunk(starts[i], starts[i + 1], chunks[i]); };
+  if(pool) pool->parallel_for(count, parse);
+  else for(size_t i = 0; i < count; i++) parse(i);
+
+  // Errors are reported for the first bad line in the file
+  size_t line = 0;
+  for(const auto& chunk : chunks)
+  {
+    if(!chunk.error.empty())
+    {
+      std::ostringstream os;
+      os << filename << ":" << line + chunk.error_line << ": " << chunk.error;
+      error = os.str();
+      return false;
+    }
+    line += chunk.lines;
+  }
+
+  // Where each chunk's vertices and indices go in the whole mesh
+  std::vector<size_t> vert_offsets(count + 1, 0), index_offsets(count + 1, 0);
+  for(size_t i = 0; i < count; i++)
+  {
+    vert_offsets[i + 1] = vert_offsets[i] + chunks[i].verts.size();
+    index_offsets[i + 1] = index_offsets[i] + chunks[i].indices.size();
+  }
+  if(index_offsets[count] == 0)
+  {
+    error = filename + " has no faces";
+    return false;
+  }
+  if(vert_offsets[count] > UINT_MAX)
+  {
+    error = filename + " has too many vertices";
+    return false;
+  }
+
+  verts.resize(vert_offsets[count]);
+  indices.resize(index_offsets[count]);
+  std::vector<char> bad(count, 0);
+  auto merge = [&](size_t i) {
+    ObjChunk& chunk = chunks[i];
+    for(size_t k : chunk.relative) chunk.indices[k] += vert_offsets[i];
+    std::copy(chunk.verts.begin(), chunk.verts.end(), verts.begin() + vert_offsets[i]);
+
+    unsigned int* out = &indices[index_offsets[i]];
+    for(size_t k = 0; k < chunk.indices.size(); k++)
+    {
+      long long index = chunk.indices[k];
+      if(index < 0 || index >= (long long)vert_offsets[count]) bad[i] = 1;
+      out[k] = index;
+    }
+
+    // Done with the chunk, let its memory go while the others are still being copied
+    std::vector<GeomPoint3D>().swap(chunk.verts);
+    std::vector<long long>().swap(chunk.indices);
+  };
+  if(pool) pool->parallel_for(count, merge);
+  else for(size_t i = 0; i < count; i++) merge(i);
+
+  if(std::find(bad.begin(), bad.end(), 1) != bad.end())
+  {
+    error = filename + " has a face with a vertex index out of range";
+    return false;
+  }
+
+  return true;
+}
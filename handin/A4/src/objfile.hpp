@@ -0,0 +1,18 @@
+#ifndef CS488_OBJFILE_HPP
+#define CS488_OBJFILE_HPP
+
+#include <string>
+#include <vector>
+#include "algebra.hpp"
+
+class ThreadPool;
+
+// Reads the vertices and faces of an Alias/Wavefront OBJ file, skipping everything else (normals, texture
+// coordinates, groups, materials). Faces are split into fans of triangles and returned as three vertex
+// indices, counted from 0, per triangle, the form Mesh takes them in. The file is memory mapped and cut
+// into chunks at line boundaries which are parsed in parallel on pool if there is one.
+// Returns false with a message in error if the file can't be read or isn't valid
+bool read_obj(const std::string& filename, std::vector<GeomPoint3D>& verts, std::vector<unsigned int>& indices,
+              std::string& error, ThreadPool* pool = NULL);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef CS488_PACKET_HPP
+#define CS488_PACKET_HPP
+
+#include <limits>
+#include "algebra.hpp"
+#include "simd.hpp"
+
+// Primary rays go through the scene in packets covering a RAY_PACKET_WIDTH x RAY_PACKET_HEIGHT block of pixels.
+// Override these at compile time to trace 4 (2x2), 8 (4x2) or 16 (4x4) rays at once
+#ifndef RAY_PACKET_WIDTH
+#define RAY_PACKET_WIDTH 4
+#endif
+#ifndef RAY_PACKET_HEIGHT
+#define RAY_PACKET_HEIGHT 4
+#endif
+
+// One axis of a slab test for DVec::WIDTH rays: narrows [t0, t1] to where the rays are between the planes at lo and
+// hi. A ray lying in one of the planes gets 0 * infinity = NaN for it, and like in the single ray tests that axis
+// then doesn't narrow its interval at all. min() and max() return their second argument if either one is NaN, so
+// NaNs are turned into the infinity that leaves t0 or t1 alone before the two planes are put in order
+inline void slab_test(DVec lo, DVec hi, DVec origin, DVec inv_dir, DVec& t0, DVec& t1)
+{
+  DVec inf(std::numeric_limits<double>::infinity()), neg_inf(-std::numeric_limits<double>::infinity());
+  DVec tn = (lo - origin) * inv_dir;
+  DVec tf = (hi - origin) * inv_dir;
+  t0 = max(t0, min(max(tn, neg_inf), max(tf, neg_inf)));
+  t1 = min(t1, max(min(tn, inf), min(tf, inf)));
+}
+
+// A bundle of rays stored a component at a time so the intersection kernels can work on DVec::WIDTH rays per
+// instruction. Directions aren't normalized when a packet is transformed into a primitive's model coordinates,
+// so t means the same thing in every coordinate system and can be compared directly across instances
+struct RayPacket {
+  static const int SIZE = RAY_PACKET_WIDTH * RAY_PACKET_HEIGHT;
+
+  alignas(32) double o[3][SIZE]; // Origins
+  alignas(32) double d[3][SIZE]; // Directions
+  alignas(32) double inv[3][SIZE]; // 1/d for the slab tests, filled in by update()
+  alignas(32) double t[SIZE]; // Distance to the closest hit so far. Lanes without a ray are set to -1 so nothing ever hits them
+
+  void set(int k, const Ray& ray, double tmax)
+  {
+    Point3D origin = ray.origin();
+    Vector3D direction = ray.direction();
+    for(int a = 0; a < 3; a++)
+    {
+      o[a][k] = origin[a];
+      d[a][k] = direction[a];
+    }
+    t[k] = tmax;
+  }
+
+  // Recomputes the reciprocal directions after the directions have been set
+  void update()
+  {
+    for(int a = 0; a < 3; a++)
+    {
+      for(int k = 0; k < SIZE; k += DVec::WIDTH) (DVec(1.0) / DVec::load(d[a] + k)).store(inv[a] + k);
+    }
+  }
+
+  bool active(int k) const
+  {
+    return t[k] >= 0.0;
+  }
+
+  // The packet in the coordinate system M transforms to, with t carried over unchanged
+  RayPacket transform(const Affine3x4& M) const
+  {
+    RayPacket p;
+    for(int k = 0; k < SIZE; k += DVec::WIDTH)
+    {
+      DVec ox = DVec::load(o[0] + k), oy = DVec::load(o[1] + k), oz = DVec::load(o[2] + k);
+      DVec dx = DVec::load(d[0] + k), dy = DVec::load(d[1] + k), dz = DVec::load(d[2] + k);
+      for(int a = 0; a < 3; a++)
+      {
+        (DVec(M[a][0])*ox + DVec(M[a][1])*oy + DVec(M[a][2])*oz + DVec(M[a][3])).store(p.o[a] + k);
+        (DVec(M[a][0])*dx + DVec(M[a][1])*dy + DVec(M[a][2])*dz).store(p.d[a] + k);
+      }
+      DVec::load(t + k).store(p.t + k);
+    }
+    p.update();
+    return p;
+  }
+
+  // transform() for a matrix that only translates by v. The directions don't change so neither does inv
+  RayPacket translate(const Vector3D& v) const
+  {
+    RayPacket p;
+    for(int a = 0; a < 3; a++)
+    {
+      for(int k = 0; k < SIZE; k += DVec::WIDTH)
+      {
+        (DVec::load(o[a] + k) + DVec(v[a])).store(p.o[a] + k);
+        DVec::load(d[a] + k).store(p.d[a] + k);
+        DVec::load(inv[a] + k).store(p.inv[a] + k);
+      }
+    }
+    for(int k = 0; k < SIZE; k += DVec::WIDTH) DVec::load(t + k).store(p.t + k);
+    return p;
+  }
+
+  // Slab test of every ray against the box. True if any ray passes through it closer than its current hit
+  bool hits(const BoundingBox& box) const
+  {
+    DVec bmin[3] = {DVec(box.min()[0]), DVec(box.min()[1]), DVec(box.min()[2])};
+    DVec bmax[3] = {DVec(box.max()[0]), DVec(box.max()[1]), DVec(box.max()[2])};
+    for(int k = 0; k < SIZE; k += DVec::WIDTH)
+    {
+      DVec t0(0.0), t1 = DVec::load(t + k);
+      for(int a = 0; a < 3; a++) slab_test(bmin[a], bmax[a], DVec::load(o[a] + k), DVec::load(inv[a] + k), t0, t1);
+      if(bits(t0 <= t1)) return true;
+    }
+    return false;
+  }
+};
+
+static_assert(RayPacket::SIZE % DVec::WIDTH == 0, "Ray packets must be a whole number of SIMD registers");
+static_assert(RayPacket::SIZE <= 32, "Lane masks are 32 bits");
+
+#endif
@@ -9,6 +9,136 @@ Primitive::~Primitive()
 {
 }
 
+bool Primitive::occluded(const Ray& ray) const
+{
+  Intersection j;
+  j.t = ray.tmax();
+  return intersect(ray, j);
+}
+
+unsigned int Primitive::intersect_packet(RayPacket& packet) const
+{
+  unsigned int mask = 0;
+  for(int k = 0; k < RayPacket::SIZE; k++)
+  {
+    if(!packet.active(k)) continue;
+
+    // The scalar ray has a normalized direction, so convert t to its units and back
+    Vector3D d(packet.d[0][k], packet.d[1][k], packet.d[2][k]);
+    Ray ray(Point3D(packet.o[0][k], packet.o[1][k], packet.o[2][k]), d);
+    double length = d.length();
+
+    Intersection j;
+    j.t = packet.t[k] * length;
+    if(!intersect(ray, j)) continue;
+
+    packet.t[k] = j.t / length;
+    mask |= 1u << k;
+  }
+  return mask;
+}
+
+// Packet version of NonhierSphere::intersect, solving the same quadratic for DVec::WIDTH rays at a time
+static unsigned int intersect_sphere_packet(RayPacket& packet, const Point3D& centre, double radius)
+{
+  unsigned int mask = 0;
+  for(int k = 0; k < RayPacket::SIZE; k += DVec::WIDTH)
+  {
+    DVec vx = DVec::load(packet.o[0] + k) - DVec(centre[0]);
+    DVec vy = DVec::load(packet.o[1] + k) - DVec(centre[1]);
+    DVec vz = DVec::load(packet.o[2] + k) - DVec(centre[2]);
+    DVec dx = DVec::load(packet.d[0] + k), dy = DVec::load(packet.d[1] + k), dz = DVec::load(packet.d[2] + k);
+
+    DVec A = dx*dx + dy*dy + dz*dz;
+    DVec B = DVec(2.0)*(dx*vx + dy*vy + dz*vz);
+    DVec C = vx*vx + vy*vy + vz*vz - DVec(radius*radius);
+    DVec discriminant = B*B - DVec(4.0)*A*C;
+
+    // Take the nearer root unless the ray starts inside the sphere
+    DVec root = sqrt(max(discriminant, DVec(0.0)));
+    DVec inv_2a = DVec(0.5) / A;
+    DVec t0 = (DVec(0.0) - B - root) * inv_2a;
+    DVec t1 = (root - B) * inv_2a;
+    DVec t = select(t0 >= DVec(0.0), t0, t1);
+
+    DVec tmax = DVec::load(packet.t + k);
+    DVec hit = (discriminant >= DVec(0.0)) & (t >= DVec(0.0)) & (t < tmax);
+    select(hit, t, tmax).store(packet.t + k);
+    mask |= bits(hit) << k;
+  }
+  return mask;
+}
+
+// Slab test of the packet against an axis aligned box. Rays starting inside the box hit it where they leave
+static unsigned int intersect_box_packet(RayPacket& packet, const Point3D& bmin, const Point3D& bmax)
+{
+  unsigned int mask = 0;
+  for(int k = 0; k < RayPacket::SIZE; k += DVec::WIDTH)
+  {
+    DVec tnear(-std::numeric_limits<double>::infinity()), tfar(std::numeric_limits<double>::infinity());
+    for(int a = 0; a < 3; a++)
+    {
+      slab_test(DVec(bmin[a]), DVec(bmax[a]), DVec::load(packet.o[a] + k), DVec::load(packet.inv[a] + k), tnear, tfar);
+    }
+    DVec t = select(tnear >= DVec(0.0), tnear, tfar);
+
+    DVec tmax = DVec::load(packet.t + k);
+    DVec hit = (tnear <= tfar) & (t >= DVec(0.0)) & (t < tmax);
+    select(hit, t, tmax).store(packet.t + k);
+    mask |= bits(hit) << k;
+  }
+  return mask;
+}
+
+// Slab test of the ray against an axis aligned box, the single ray version of intersect_box_packet. The face the
+// ray enters through, or leaves through if it starts inside the box, is stored in j.primitive as 2*axis, plus 1
+// for the face on the positive side
+static bool intersect_box(const Ray& ray, const Point3D& bmin, const Point3D& bmax, Intersection& j)
+{
+  const Point3D& o = ray.origin();
+  const Vector3D& inv_dir = ray.inv_direction();
+
+  double tnear = -std::numeric_limits<double>::infinity(), tfar = std::numeric_limits<double>::infinity();
+  int near_axis = 0, far_axis = 0;
+  for(int a = 0; a < 3; a++)
+  {
+    // Rays heading in the negative direction enter through the max face. Picking the faces by direction instead of
+    // putting the two t in order means a 0 * infinity NaN, from a ray lying in a face's plane, fails both compares
+    // below and leaves the interval alone, the same as slab_test() does for packets
+    double tn = ((ray.sign(a) ? bmax[a] : bmin[a]) - o[a]) * inv_dir[a];
+    double tf = ((ray.sign(a) ? bmin[a] : bmax[a]) - o[a]) * inv_dir[a];
+    if(tn > tnear)
+    {
+      tnear = tn;
+      near_axis = a;
+    }
+    if(tf < tfar)
+    {
+      tfar = tf;
+      far_axis = a;
+    }
+  }
+  if(tnear > tfar) return false;
+
+  bool inside = tnear < ray.tmin();
+  double t = inside ? tfar : tnear;
+  if(t < ray.tmin() || t > ray.tmax() || j.t < t) return false;
+
+  // Rays heading in the negative direction enter through the max face and leave through the min face
+  int axis = inside ? far_axis : near_axis;
+  j.t = t;
+  j.primitive = 2*axis + (((ray.direction()[axis] < 0.0) != inside) ? 1 : 0);
+  return true;
+}
+
+// Outward normal of the face intersect_box() stored in j.primitive
+static Vector3D box_normal(const Intersection& j)
+{
+  Vector3D n(0.0, 0.0, 0.0);
+  n[j.primitive / 2] = (j.primitive & 1) ? 1.0 : -1.0;
+  return n;
+}
+
 Sphere::~Sphere()
 {
 }
@@ -19,21 +149,56 @@ bool Sphere::intersect(const Ray& ray, Intersection& j) const
   return sphere.intersect(ray, j);
 }
 
+Vector3D Sphere::get_normal(const Ray& ray, const Intersection& j) const
+{
+  return ray.origin() + j.t*ray.direction() - Point3D(0.0, 0.0, 0.0);
+}
+
+bool Sphere::occluded(const Ray& ray) const
+{
+  NonhierSphere sphere(Point3D(0.0, 0.0, 0.0), 1.0);
+  return sphere.occluded(ray);
+}
+
+unsigned int Sphere::intersect_packet(RayPacket& packet) const
+{
+  return intersect_sphere_packet(packet, Point3D(0.0, 0.0, 0.0), 1.0);
+}
+
+BoundingBox Sphere::get_bounds() const
+{
+  return BoundingBox(Point3D(-1.0, -1.0, -1.0), Point3D(1.0, 1.0, 1.0));
+}
+
 Cube::~Cube()
 {
 }
 
 bool Cube::intersect(const Ray& ray, Intersection& j) const
 {
-  NonhierBox box(Point3D(0.0, 0.0, 0.0), 1.0);
-  return box.intersect(ray, j);
+  return intersect_box(ray, Point3D(0.0, 0.0, 0.0), Point3D(1.0, 1.0, 1.0), j);
+}
+
+Vector3D Cube::get_normal(const Ray&, const Intersection& j) const
+{
+  return box_normal(j);
+}
+
+unsigned int Cube::intersect_packet(RayPacket& packet) const
+{
+  return intersect_box_packet(packet, Point3D(0.0, 0.0, 0.0), Point3D(1.0, 1.0, 1.0));
+}
+
+BoundingBox Cube::get_bounds() const
+{
+  return BoundingBox(Point3D(0.0, 0.0, 0.0), Point3D(1.0, 1.0, 1.0));
 }
 
 NonhierSphere::~NonhierSphere()
 {
 }
 
-bool NonhierSphere::intersect(const Ray& ray, Intersection& j) const
+bool NonhierSphere::nearest_root(const Ray& ray, double& t) const
 {
   // Ray/sphere intersection test
   // Equation for a sphere centered at p_c with radius r and arbitrary point on the sphere p:
@@ -62,79 +227,74 @@ bool NonhierSphere::intersect(const Ray& ray, Intersection& j) const
   // If there is two roots, then one is the intersection with the sphere from the front as the ray enters the sphere
   // and the other is the intersection through the back as it leaves the sphere
   // For this case we only take the smallest t value since that is the point where the ray enters the sphere which
-  // will be the visible point of the sphere. Of course t must not be negative otherwise it is behind the eye point
+  // will be the visible point of the sphere. Of course t must not be before the start of the ray otherwise it is
+  // behind the eye point
   if(num_roots > 0)
   {
     // If the ray orginates inside the sphere, then we need to get the max of both roots
     // Otherwise we use the min. If there is only one root, then just use that of course
-    // If t is still less than 0 than the sphere is completely behind the ray's origin
+    // If t is still less than tmin than the sphere is completely behind the ray's origin
     double min = std::min<double>(roots[0], roots[1]);
-    double t = (num_roots == 1) ? roots[0] : ((min < 0) ? std::max<double>(roots[0], roots[1]) : min);
-    if(t < 0) return false;
-    j.q = ray.origin() + t*ray.direction();
-    j.n = (j.q - m_pos).normalized();
-    return true;
+    t = (num_roots == 1) ? roots[0] : ((min < ray.tmin()) ? std::max<double>(roots[0], roots[1]) : min);
+    return t >= ray.tmin() && t <= ray.tmax();
   }
   
   return false;
 }
 
-NonhierBox::~NonhierBox()
+bool NonhierSphere::intersect(const Ray& ray, Intersection& j) const
 {
+  // The far root is only taken when the near one is behind the ray, so a root beyond j.t means the whole sphere is
+  // behind the closest hit so far
+  double t;
+  if(!nearest_root(ray, t) || t >= j.t) return false;
+
+  j.t = t;
+  return true;
 }
 
-bool NonhierBox::intersect(const Ray& ray, Intersection& j) const
+Vector3D NonhierSphere::get_normal(const Ray& ray, const Intersection& j) const
 {
-  // This algorithm is kinda inefficient but it fucking works so whatevs
-  // First gather the points and normals for all faces
-  double x = m_pos[0], y = m_pos[1], z = m_pos[2], r = m_size;
-  Point3D fp[6][4] = {
-    {Point3D(x, y, z), Point3D(x+r, y, z), Point3D(x+r, y+r, z), Point3D(x, y+r, z)},
-    {Point3D(x, y+r, z), Point3D(x+r, y+r, z), Point3D(x+r, y+r, z+r), Point3D(x, y+r, z+r)},
-    {Point3D(x+r, y, z), Point3D(x+r, y, z+r), Point3D(x+r, y+r, z+r), Point3D(x+r, y+r, z)},
-    {Point3D(x, y, z), Point3D(x, y+r, z), Point3D(x, y+r, z+r), Point3D(x, y, z+r)},
-    {Point3D(x, y, z+r), Point3D(x, y+r, z+r), Point3D(x+r, y+r, z+r), Point3D(x+r, y, z+r)},
-    {Point3D(x, y, z), Point3D(x, y, z+r), Point3D(x+r, y, z+r), Point3D(x+r, y, z)}
-  };
-  Vector3D fn[6] = {
-    (fp[0][2]-fp[0][0]).cross(fp[0][1]-fp[0][0]).normalized(),
-    (fp[1][2]-fp[1][0]).cross(fp[1][1]-fp[1][0]).normalized(),
-    (fp[2][2]-fp[2][0]).cross(fp[2][1]-fp[2][0]).normalized(),
-    (fp[3][2]-fp[3][0]).cross(fp[3][1]-fp[3][0]).normalized(),
-    (fp[4][2]-fp[4][0]).cross(fp[4][1]-fp[4][0]).normalized(),
-    (fp[5][2]-fp[5][0]).cross(fp[5][1]-fp[5][0]).normalized(),
-  };
-
-  // This works similar to polygon intersection where we find the parameter t
-  // which gives the intersection point of the ray with the plane containing the
-  // face. We then check if the point is "inside" each of the edges of the face
-  double prev_t = std::numeric_limits<double>::infinity();
-  bool intersection = false;
-  for(int i = 0; i < 6; i++)
-  {
-    double den = fn[i].dot(ray.direction());
-    if(fabs(den) < std::numeric_limits<double>::epsilon()) continue;
+  return ray.origin() + j.t*ray.direction() - m_pos;
+}
 
-    double t = (fp[i][0] - ray.origin()).dot(fn[i]) / den;
-    if(t < 0) continue;
+bool NonhierSphere::occluded(const Ray& ray) const
+{
+  double t;
+  return nearest_root(ray, t) && t < ray.tmax();
+}
 
-    if(prev_t < t) continue;
+unsigned int NonhierSphere::intersect_packet(RayPacket& packet) const
+{
+  return intersect_sphere_packet(packet, m_pos, m_radius);
+}
 
-    Point3D Q = ray.origin() + t*ray.direction();
+BoundingBox NonhierSphere::get_bounds() const
+{
+  Vector3D r(m_radius, m_radius, m_radius);
+  return BoundingBox(m_pos - r, m_pos + r);
+}
 
-    // The cross product of the two vectors should give a vector that is in a similar direction to
-    // the normal of the face
-    if((fp[i][0]-fp[i][1]).cross(Q-fp[i][1]).dot(fn[i]) < 0) continue;
-    if((fp[i][1]-fp[i][2]).cross(Q-fp[i][2]).dot(fn[i]) < 0) continue;
-    if((fp[i][2]-fp[i][3]).cross(Q-fp[i][3]).dot(fn[i]) < 0) continue;
-    if((fp[i][3]-fp[i][0]).cross(Q-fp[i][0]).dot(fn[i]) < 0) continue;
+NonhierBox::~NonhierBox()
+{
+}
 
-    prev_t = t;
-    intersection = true;
-    j.q = Q;
-    j.n = fn[i];
-  }
+bool NonhierBox::intersect(const Ray& ray, Intersection& j) const
+{
+  return intersect_box(ray, m_pos, m_pos + Vector3D(m_size, m_size, m_size), j);
+}
+
+Vector3D NonhierBox::get_normal(const Ray&, const Intersection& j) const
+{
+  return box_normal(j);
+}
 
-  return intersection;
+unsigned int NonhierBox::intersect_packet(RayPacket& packet) const
+{
+  return intersect_box_packet(packet, m_pos, m_pos + Vector3D(m_size, m_size, m_size));
 }
 
+BoundingBox NonhierBox::get_bounds() const
+{
+  return BoundingBox(m_pos, m_pos + Vector3D(m_size, m_size, m_size));
+}
@@ -2,15 +2,40 @@
 #define CS488_PRIMITIVE_HPP
 
 #include "algebra.hpp"
+#include "packet.hpp"
 
 class Primitive {
 public:
   virtual ~Primitive();
 
+  // Finds the closest hit with ray.tmin() <= t <= ray.tmax() that is also closer than j.t, and fills in j.t and
+  // whichever of j.primitive, j.u and j.v get_normal() needs. Hits at or beyond j.t are rejected, so passing
+  // the closest hit found so far prunes everything behind it
   virtual bool intersect(const Ray& ray, Intersection& j) const
   {
     return false;
   }
+
+  // Surface normal in model coordinates at a hit intersect() reported for the same ray. Only worked out for the
+  // closest hit of a ray so intersect() doesn't have to. Doesn't have to be unit length
+  virtual Vector3D get_normal(const Ray&, const Intersection&) const
+  {
+    return Vector3D(0.0, 0.0, 0.0);
+  }
+
+  // True if the ray hits the primitive anywhere in [ray.tmin(), ray.tmax()). Stops at the first hit it finds and
+  // doesn't work out normals, which is all shadow rays need. The default falls back on intersect()
+  virtual bool occluded(const Ray& ray) const;
+
+  // Intersects every active ray in the packet at once, lowering t for the rays that hit closer than their
+  // current t. Returns a mask with bit k set if ray k's t was lowered. The default traces the rays one by one
+  virtual unsigned int intersect_packet(RayPacket& packet) const;
+
+  // Axis aligned bounds of the primitive in its own model coordinates
+  virtual BoundingBox get_bounds() const
+  {
+    return BoundingBox();
+  }
 };
 
 class Sphere : public Primitive {
@@ -18,6 +43,10 @@ public:
   virtual ~Sphere();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual Vector3D get_normal(const Ray& ray, const Intersection& j) const;
+  virtual bool occluded(const Ray& ray) const;
+  virtual unsigned int intersect_packet(RayPacket& packet) const;
+  virtual BoundingBox get_bounds() const;
 };
 
 class Cube : public Primitive {
@@ -25,6 +54,9 @@ public:
   virtual ~Cube();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual Vector3D get_normal(const Ray& ray, const Intersection& j) const;
+  virtual unsigned int intersect_packet(RayPacket& packet) const;
+  virtual BoundingBox get_bounds() const;
 };
 
 class NonhierSphere : public Primitive {
@@ -36,10 +68,17 @@ public:
   virtual ~NonhierSphere();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual Vector3D get_normal(const Ray& ray, const Intersection& j) const;
+  virtual bool occluded(const Ray& ray) const;
+  virtual unsigned int intersect_packet(RayPacket& packet) const;
+  virtual BoundingBox get_bounds() const;
 
 private:
   Point3D m_pos;
   double m_radius;
+
+  // The parameter t of the visible point where the ray hits the sphere, if it does
+  bool nearest_root(const Ray& ray, double& t) const;
 };
 
 class NonhierBox : public Primitive {
@@ -52,6 +91,9 @@ public:
   virtual ~NonhierBox();
 
   virtual bool intersect(const Ray& ray, Intersection& j) const;
+  virtual Vector3D get_normal(const Ray& ray, const Intersection& j) const;
+  virtual unsigned int intersect_packet(RayPacket& packet) const;
+  virtual BoundingBox get_bounds() const;
 
 private:
   Point3D m_pos;
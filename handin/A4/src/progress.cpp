@@ -0,0 +1,88 @@
+#include "progress.hpp"
+#include "threadpool.hpp"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+// Formats a number of seconds as m:ss
+static std::string format_time(double seconds)
+{
+  long s = (long)(seconds + 0.5);
+  std::ostringstream os;
+  os << s / 60 << ":" << std::setw(2) << std::setfill('0') << s % 60;
+  return os.str();
+}
+
+// Formats a count with a k/M/G suffix
+static std::string format_count(double n)
+{
+  const char* suffix = "";
+  if(n >= 1e9) { n /= 1e9; suffix = "G"; }
+  else if(n >= 1e6) { n /= 1e6; suffix = "M"; }
+  else if(n >= 1e3) { n /= 1e3; suffix = "k"; }
+
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(1) << n << suffix;
+  return os.str();
+}
+
+Progress::Progress(unsigned int threads, long long total_pixels)
+  : m_counters(threads + 1) // The extra counter is for threads outside the pool
+  , m_total_pixels(total_pixels)
+  , m_start(std::chrono::steady_clock::now())
+{
+  for(auto& counter : m_counters)
+  {
+    counter.pixels = 0;
+    counter.rays = 0;
+  }
+}
+
+void Progress::add(long long pixels, long long rays)
+{
+  int index = ThreadPool::worker_index();
+  Counter& counter = m_counters[(index >= 0 && index + 1 < (int)m_counters.size()) ? index : m_counters.size() - 1];
+
+  // Only ever written by one thread, so relaxed ordering is all that's needed for the main thread to read it
+  counter.pixels.fetch_add(pixels, std::memory_order_relaxed);
+  counter.rays.fetch_add(rays, std::memory_order_relaxed);
+}
+
+void Progress::totals(long long& pixels, long long& rays) const
+{
+  pixels = 0;
+  rays = 0;
+  for(const auto& counter : m_counters)
+  {
+    pixels += counter.pixels.load(std::memory_order_relaxed);
+    rays += counter.rays.load(std::memory_order_relaxed);
+  }
+}
+
+double Progress::elapsed() const
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+void Progress::report(std::ostream& out) const
+{
+  long long pixels, rays;
+  totals(pixels, rays);
+  double seconds = elapsed();
+
+  out << "progress: " << std::setw(3) << (m_total_pixels > 0 ? 100 * pixels / m_total_pixels : 100) << "%"
+      << " | " << format_count(seconds > 0.0 ? rays / seconds : 0.0) << " rays/s"
+      << " | ETA " << (pixels > 0 ? format_time(seconds * (m_total_pixels - pixels) / pixels) : std::string("?:??"))
+      << "   \r" << std::flush;
+}
+
+void Progress::finish(std::ostream& out) const
+{
+  long long pixels, rays;
+  totals(pixels, rays);
+  double seconds = elapsed();
+
+  out << "progress: 100% | rendered in " << format_time(seconds) << ", "
+      << format_count(rays) << " rays (" << format_count(seconds > 0.0 ? rays / seconds : 0.0) << " rays/s)"
+      << std::string(10, ' ') << std::endl;
+}
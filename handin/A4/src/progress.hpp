@@ -0,0 +1,43 @@
+#ifndef CS488_PROGRESS_HPP
+#define CS488_PROGRESS_HPP
+
+#include <iosfwd>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include "mappedarray.hpp"
+
+// Tracks how far along a render is. Each thread counts the pixels and rays it finishes in its own
+// counters, padded out to a cache line so threads never fight over them, and report() sums them up
+// whenever the main thread wakes up to print the progress.
+class Progress {
+public:
+  // threads is the number of worker threads that will be adding to the counts
+  Progress(unsigned int threads, long long total_pixels);
+
+  // Called from the worker threads
+  void add(long long pixels, long long rays);
+
+  // Prints one status line with the percentage done, rays per second and time remaining
+  void report(std::ostream& out) const;
+
+  // Prints the time the whole render took and the average ray throughput
+  void finish(std::ostream& out) const;
+
+private:
+  // One cache line each, allocated aligned so no two threads' counters ever share a line
+  struct alignas(64) Counter {
+    std::atomic<long long> pixels;
+    std::atomic<long long> rays;
+  };
+  static_assert(sizeof(Counter) == 64, "Counter should fill exactly one cache line");
+
+  std::vector<Counter, AlignedAllocator<Counter> > m_counters;
+  long long m_total_pixels;
+  std::chrono::steady_clock::time_point m_start;
+
+  void totals(long long& pixels, long long& rays) const;
+  double elapsed() const;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "scene.hpp"
 #include <iostream>
 #include <cctype>
+#include <limits>
 
 SceneNode::SceneNode(const std::string& name)
   : m_name(name)
@@ -11,19 +12,23 @@ SceneNode::~SceneNode()
 {
 }
 
+// Each of these applies a transform T before the node's existing transform M. The inverse of M*T is
+// T^-1 * M^-1, and T^-1 is just the opposite rotation, scale or translation
+
 void SceneNode::rotate(char axis, double angle)
 {
-  set_transform(m_trans.rotate(angle, (tolower(axis) == 'x') ? 1.0 : 0.0, (tolower(axis) == 'y') ? 1.0 : 0.0, (tolower(axis) == 'z') ? 1.0 : 0.0));
+  Vector3D v((tolower(axis) == 'x') ? 1.0 : 0.0, (tolower(axis) == 'y') ? 1.0 : 0.0, (tolower(axis) == 'z') ? 1.0 : 0.0);
+  set_transform(m_trans.rotate(angle, v), Affine3x4().rotate(-angle, v) * m_invtrans);
 }
 
 void SceneNode::scale(const Vector3D& amount)
 {
-  set_transform(m_trans.scale(amount));
+  set_transform(m_trans.scale(amount), Affine3x4().scale(1.0 / amount[0], 1.0 / amount[1], 1.0 / amount[2]) * m_invtrans);
 }
 
 void SceneNode::translate(const Vector3D& amount)
 {
-  set_transform(m_trans.translate(amount));
+  set_transform(m_trans.translate(amount), Affine3x4().translate(-amount) * m_invtrans);
 }
 
 bool SceneNode::is_joint() const
@@ -31,37 +36,50 @@ bool SceneNode::is_joint() const
   return false;
 }
 
-bool SceneNode::intersect(const Ray& ray, Intersection& i) const
+bool SceneNode::intersect(const Ray& ray, MaterialTable& materials, Intersection& i, SurfacePoint& s) const
 {
-  // Transform the ray from WCS->MCS for this node
-  Ray r(m_invtrans * ray.origin(), m_invtrans * ray.direction());
+  // Transform the ray from WCS->MCS for this node. t is the same in both so i.t still prunes the children
+  Ray r = ray.transform(m_invtrans);
 
+  // Children only report hits closer than i.t, so whatever is left in i and s after the loop is the closest one
   bool intersects = false;
   for(auto child : m_children)
   {
-    Intersection j;
-    if(child->intersect(r, j))
-    {
-      // We need to see if this intersection point is closer than the previous intersection point
-      // If it is than replace the previous intersection
-      if(std::isinf(i.q[0]) || std::isinf(i.q[1]) || std::isinf(i.q[2]) || (j.q-r.origin()).length() < (i.q-r.origin()).length()) i = j;
-      intersects = true;
-    }
+    if(child->intersect(r, materials, i, s)) intersects = true;
   }
 
-  // If intersection occurs than transform the intersection point and the normal from MCS->WCS
-  // We have to convert the intersection point from MCS->WCS and the normal from MCS->WCS
-  // Normals must be multiplied by the transpose of the inverse to throw away scaling (no translations either, but the normal is 
-  // a vector and vectors can't be translated) but preserve rotation
+  // The hit point goes back through this node's transform and the normal through the transpose of its inverse,
+  // which keeps rotations but throws away the scaling
   if(intersects)
   {
-    i.q = m_trans * i.q;
-    i.n = transNorm(m_invtrans, i.n).normalized();
+    s.q = m_trans * s.q;
+    s.n = transNorm(m_invtrans, s.n).normalized();
   }
-  
+
   return intersects;
 }
 
+bool SceneNode::occluded(const Ray& ray) const
+{
+  // Transform the ray from WCS->MCS for this node
+  Ray r = ray.transform(m_invtrans);
+
+  for(auto child : m_children)
+  {
+    if(child->occluded(r)) return true;
+  }
+
+  return false;
+}
+
+void SceneNode::flatten(const Affine3x4& trans, const Affine3x4& invtrans, std::vector<GeometryInstance>& instances) const
+{
+  Affine3x4 t = trans * m_trans;
+  Affine3x4 inv = m_invtrans * invtrans;
+
+  for(auto child : m_children) child->flatten(t, inv, instances);
+}
+
 JointNode::JointNode(const std::string& name)
   : SceneNode(name)
 {
@@ -96,25 +114,177 @@ GeometryNode::GeometryNode(const std::string& name, Primitive* primitive)
 {
 }
 
-bool GeometryNode::intersect(const Ray& ray, Intersection& i) const
+bool GeometryNode::intersect(const Ray& ray, MaterialTable& materials, Intersection& i, SurfacePoint& s) const
 {
   // Test for intersection
   // But first transform ray to geometry's model coordinates (inverse transform from WCS->MCS)
-  Ray r(m_invtrans * ray.origin(), m_invtrans * ray.direction());
+  Ray r = ray.transform(m_invtrans);
+
+  bool intersects = m_primitive->intersect(r, i);
+  if(intersects)
+  {
+    s.q = m_trans * (r.origin() + i.t*r.direction());
+    s.n = transNorm(m_invtrans, m_primitive->get_normal(r, i)).normalized();
+    s.material = materials.add(m_material);
+  }
+
+  // The children only replace the primitive's hit if they find something closer
+  if(SceneNode::intersect(ray, materials, i, s)) intersects = true;
+
+  return intersects;
+}
+
+bool GeometryNode::occluded(const Ray& ray) const
+{
+  return m_primitive->occluded(ray.transform(m_invtrans)) || SceneNode::occluded(ray);
+}
 
-  Intersection k;
-  bool intersects = m_primitive->intersect(r, k);
-  if(intersects) 
+// Sorts an instance's transform into one of the GeometryInstance kinds. Only exact matches count so the
+// fast paths give the same results as multiplying by the matrices would
+static GeometryInstance::Kind classify_transform(const Affine3x4& m)
+{
+  for(int r = 0; r < 3; r++)
   {
-    i.q = m_trans * k.q;
-    i.n = transNorm(m_invtrans, k.n).normalized();
-    i.m = m_material;
+    for(int c = 0; c < 3; c++)
+    {
+      if(m[r][c] != ((r == c) ? 1.0 : 0.0)) return GeometryInstance::GENERAL;
+    }
   }
 
-  return (intersects || SceneNode::intersect(ray, i));
+  return (m[0][3] == 0.0 && m[1][3] == 0.0 && m[2][3] == 0.0) ? GeometryInstance::IDENTITY : GeometryInstance::TRANSLATION;
+}
+
+void GeometryNode::flatten(const Affine3x4& trans, const Affine3x4& invtrans, std::vector<GeometryInstance>& instances) const
+{
+  GeometryInstance instance;
+  instance.node = this;
+  instance.trans = trans * m_trans;
+  instance.invtrans = m_invtrans * invtrans;
+  // Classified by the inverse, which is what rays are taken into model coordinates with
+  instance.kind = classify_transform(instance.invtrans);
+  instance.offset = instance.invtrans.translation();
+  instance.material = 0;
+  instances.push_back(instance);
+
+  SceneNode::flatten(trans, invtrans, instances);
 }
 
 GeometryNode::~GeometryNode()
 {
 }
- 
+
+SceneBVH::SceneBVH(const SceneNode* root)
+{
+  std::vector<GeometryInstance> instances;
+  root->flatten(Affine3x4(), Affine3x4(), instances);
+
+  // Primitives without bounds can never be hit so leave them out of the tree altogether.
+  // The materials of the rest are copied into the material table as they're found
+  std::vector<BoundingBox> bounds;
+  for(const auto& instance : instances)
+  {
+    BoundingBox b = instance.node->get_primitive()->get_bounds().transform(instance.trans);
+    if(b.empty()) continue;
+
+    m_instances.push_back(instance);
+    m_instances.back().material = m_materials.add(instance.node->get_material());
+    bounds.push_back(b);
+  }
+
+  // The boxes depend on both the geometry and the transforms, so a scene whose instances haven't moved gets
+  // its tree back from the cache
+  m_bvh.build_cached(bounds);
+}
+
+bool SceneBVH::intersect(const Ray& ray, Intersection& i) const
+{
+  double tmax = std::min(ray.tmax(), i.t);
+
+  return m_bvh.intersect(ray, tmax, [&](unsigned int index, double& t) {
+    if(!intersect_instance(index, ray, i)) return false;
+    t = i.t;
+    return true;
+  });
+}
+
+// Transforms the ray from WCS->MCS for the instance
+static Ray to_model(const GeometryInstance& instance, const Ray& ray)
+{
+  switch(instance.kind)
+  {
+  case GeometryInstance::IDENTITY:
+    return ray;
+  case GeometryInstance::TRANSLATION:
+    return ray.translate(instance.offset);
+  default:
+    return ray.transform(instance.invtrans);
+  }
+}
+
+bool SceneBVH::occluded(const Ray& ray) const
+{
+  return m_bvh.occluded(ray, [&](unsigned int index) {
+    const GeometryInstance& instance = m_instances[index];
+    return instance.node->get_primitive()->occluded(to_model(instance, ray));
+  });
+}
+
+bool SceneBVH::intersect(const Ray& ray, int index, Intersection& i) const
+{
+  return intersect_instance(index, ray, i);
+}
+
+bool SceneBVH::intersect_instance(unsigned int index, const Ray& ray, Intersection& i) const
+{
+  // Transform the ray from WCS->MCS for this instance. The direction isn't renormalized so the primitive's t
+  // is directly comparable with the hits already found in every other instance
+  const GeometryInstance& instance = m_instances[index];
+  if(!instance.node->get_primitive()->intersect(to_model(instance, ray), i)) return false;
+
+  i.instance = index;
+  return true;
+}
+
+SurfacePoint SceneBVH::get_surface(const Ray& ray, const Intersection& i) const
+{
+  const GeometryInstance& instance = m_instances[i.instance];
+
+  SurfacePoint s;
+  s.q = ray.origin() + i.t*ray.direction();
+  s.n = instance.node->get_primitive()->get_normal(to_model(instance, ray), i);
+  // Translations don't change normals
+  if(instance.kind == GeometryInstance::GENERAL) s.n = transNorm(instance.invtrans, s.n);
+  s.n.normalize();
+  s.material = instance.material;
+  return s;
+}
+
+void SceneBVH::intersect(RayPacket& packet, int* hits) const
+{
+  m_bvh.intersect(packet, [&](unsigned int index) {
+    const GeometryInstance& instance = m_instances[index];
+
+    const Primitive* primitive = instance.node->get_primitive();
+
+    // Instances already in world coordinates can lower the packet's t directly
+    if(instance.kind == GeometryInstance::IDENTITY)
+    {
+      unsigned int mask = primitive->intersect_packet(packet);
+      for(int k = 0; mask != 0; k++, mask >>= 1)
+      {
+        if(mask & 1) hits[k] = index;
+      }
+      return;
+    }
+
+    // Packets aren't renormalized in model coordinates so the t each primitive finds is already a world distance
+    RayPacket local = (instance.kind == GeometryInstance::TRANSLATION) ? packet.translate(instance.offset) : packet.transform(instance.invtrans);
+    unsigned int mask = primitive->intersect_packet(local);
+    for(int k = 0; mask != 0; k++, mask >>= 1)
+    {
+      if(!(mask & 1)) continue;
+      packet.t[k] = local.t[k];
+      hits[k] = index;
+    }
+  });
+}
@@ -6,22 +6,50 @@
 #include "primitive.hpp"
 #include "mesh.hpp"
 #include "material.hpp"
+#include "bvh.hpp"
+
+class GeometryNode;
+
+// What shading needs to know about the closest hit of a ray, worked out once from its Intersection
+struct SurfacePoint {
+  Point3D q; // Hit point in world coordinates
+  Vector3D n; // Unit surface normal in world coordinates
+  unsigned int material; // Index in the scene's MaterialTable
+};
+
+// A GeometryNode placed in the world, with the transforms of all the nodes above it composed into one
+struct GeometryInstance {
+  // Which kind of transform invtrans is. Instances that are only moved around skip the matrix multiplies and
+  // the normal transform entirely
+  enum Kind {
+    IDENTITY,
+    TRANSLATION, // invtrans moves points by offset
+    GENERAL
+  };
+
+  const GeometryNode* node;
+  Affine3x4 trans;
+  Affine3x4 invtrans;
+  Kind kind;
+  Vector3D offset;
+  unsigned int material; // Index in the scene's MaterialTable
+};
 
 class SceneNode {
 public:
   SceneNode(const std::string& name);
   virtual ~SceneNode();
 
-  const Matrix4x4& get_transform() const { return m_trans; }
-  const Matrix4x4& get_inverse() const { return m_invtrans; }
+  const Affine3x4& get_transform() const { return m_trans; }
+  const Affine3x4& get_inverse() const { return m_invtrans; }
   
-  void set_transform(const Matrix4x4& m)
+  void set_transform(const Affine3x4& m)
   {
     m_trans = m;
     m_invtrans = m.invert();
   }
 
-  void set_transform(const Matrix4x4& m, const Matrix4x4& i)
+  void set_transform(const Affine3x4& m, const Affine3x4& i)
   {
     m_trans = m;
     m_invtrans = i;
@@ -37,7 +65,18 @@ public:
     m_children.remove(child);
   }
 
-  virtual bool intersect(const Ray& ray, Intersection& i) const;
+  // Finds the closest hit in the subtree that is nearer than i.t, like Primitive::intersect(), by walking the
+  // hierarchy instead of going through a SceneBVH. s gets the hit in this node's parent's coordinates, with its
+  // material's index in materials, which materials are added to as they are hit
+  virtual bool intersect(const Ray& ray, MaterialTable& materials, Intersection& i, SurfacePoint& s) const;
+
+  // True if anything in the subtree blocks the ray before ray.tmax(). Returns at the first
+  // blocking hit without working out normals or materials
+  virtual bool occluded(const Ray& ray) const;
+
+  // Appends an instance for every GeometryNode in the subtree rooted at this node. trans/invtrans is the
+  // transform from this node's parent to world coordinates
+  virtual void flatten(const Affine3x4& trans, const Affine3x4& invtrans, std::vector<GeometryInstance>& instances) const;
 
   // Callbacks to be implemented.
   // These will be called from Lua.
@@ -54,9 +93,9 @@ protected:
   int m_id;
   std::string m_name;
 
-  // Transformations
-  Matrix4x4 m_trans;
-  Matrix4x4 m_invtrans;
+  // Transformations. Both are kept up to date so the inverse never has to be computed from scratch
+  Affine3x4 m_trans;
+  Affine3x4 m_invtrans;
 
   // Hierarchy
   typedef std::list<SceneNode*> ChildList;
@@ -89,7 +128,14 @@ public:
                Primitive* primitive);
   virtual ~GeometryNode();
 
-  virtual bool intersect(const Ray& ray, Intersection& i) const;
+  virtual bool intersect(const Ray& ray, MaterialTable& materials, Intersection& i, SurfacePoint& s) const;
+  virtual bool occluded(const Ray& ray) const;
+  virtual void flatten(const Affine3x4& trans, const Affine3x4& invtrans, std::vector<GeometryInstance>& instances) const;
+
+  const Primitive* get_primitive() const
+  {
+    return m_primitive;
+  }
 
   const Material* get_material()
   {
@@ -110,4 +156,49 @@ protected:
   Primitive* m_primitive;
 };
 
+// The whole scene flattened into a list of instances in world coordinates with a BVH over them.
+// Built once before rendering so rays only visit the geometry near them instead of walking every
+// child of every node in the hierarchy. Also holds the table of materials that hits refer to
+class SceneBVH {
+public:
+  SceneBVH(const SceneNode* root);
+
+  bool intersect(const Ray& ray, Intersection& i) const;
+
+  // Finds the closest instance hit by every ray in the packet. hits[k] is set to the index of
+  // the instance ray k hit, or left alone if it didn't hit anything closer than its t
+  void intersect(RayPacket& packet, int* hits) const;
+
+  // True if any instance blocks the ray before ray.tmax(), for shadow rays
+  bool occluded(const Ray& ray) const;
+
+  // Intersects the ray with just the one instance, to fill in the details of a hit found by a packet
+  bool intersect(const Ray& ray, int index, Intersection& i) const;
+
+  // The hit point, normal and material of a hit the ray found with intersect()
+  SurfacePoint get_surface(const Ray& ray, const Intersection& i) const;
+
+  size_t size() const
+  {
+    return m_instances.size();
+  }
+
+  const MaterialData& get_material(unsigned int index) const
+  {
+    return m_materials[index];
+  }
+
+  const BVH& bvh() const
+  {
+    return m_bvh;
+  }
+
+private:
+  std::vector<GeometryInstance> m_instances;
+  MaterialTable m_materials;
+  BVH m_bvh;
+
+  bool intersect_instance(unsigned int index, const Ray& ray, Intersection& i) const;
+};
+
 #endif
@@ -41,10 +41,14 @@
 #include <cstring>
 #include <cstdio>
 #include <vector>
+#include <algorithm>
+#include <chrono>
 #include "lua488.hpp"
 #include "light.hpp"
 #include "a4.hpp"
 #include "mesh.hpp"
+#include "meshcache.hpp"
+#include "threadpool.hpp"
 
 // Uncomment the following line to enable debugging messages
 // #define GRLUA_ENABLE_DEBUG
@@ -101,6 +105,42 @@ void get_tuple(lua_State* L, int arg, T* data, int n)
   }
 }
 
+// Useful functions to retrieve optional fields of a table. value is
+// left alone if the field isn't set.
+void get_field(lua_State* L, int arg, const char* name, bool& value)
+{
+  lua_getfield(L, arg, name);
+  if (!lua_isnil(L, -1)) value = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+}
+
+void get_field(lua_State* L, int arg, const char* name, double& value)
+{
+  lua_getfield(L, arg, name);
+  if (!lua_isnil(L, -1)) {
+    luaL_argcheck(L, lua_isnumber(L, -1), arg, "Number expected for option");
+    value = lua_tonumber(L, -1);
+  }
+  lua_pop(L, 1);
+}
+
+void get_field(lua_State* L, int arg, const char* name, std::string& value)
+{
+  lua_getfield(L, arg, name);
+  if (!lua_isnil(L, -1)) {
+    luaL_argcheck(L, lua_isstring(L, -1), arg, "String expected for option");
+    value = lua_tostring(L, -1);
+  }
+  lua_pop(L, 1);
+}
+
+void get_field(lua_State* L, int arg, const char* name, int& value)
+{
+  double d = value;
+  get_field(L, arg, name, d);
+  value = (int)d;
+}
+
 // Create a node
 extern "C"
 int gr_node_cmd(lua_State* L)
@@ -290,6 +330,40 @@ int gr_mesh_cmd(lua_State* L)
   return 1;
 }
 
+// Read a mesh straight from an OBJ file, or a mesh file written by rt -convert
+extern "C"
+int gr_objmesh_cmd(lua_State* L)
+{
+  GRLUA_DEBUG_CALL;
+
+  gr_node_ud* data = (gr_node_ud*)lua_newuserdata(L, sizeof(gr_node_ud));
+  data->node = 0;
+
+  const char* name = luaL_checkstring(L, 1);
+  const char* filename = luaL_checkstring(L, 2);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  // Goes through the mesh cache, so only the first load of a file has to parse it and build its BVH
+  std::string error;
+  Mesh* mesh = load_obj_mesh(filename, error, &render_pool());
+  if (!mesh) {
+    luaL_error(L, "%s", error.c_str());
+  }
+  GRLUA_DEBUG(*mesh);
+  data->node = new GeometryNode(name, mesh);
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "Loaded " << filename << ": " << mesh->vertex_count() << " vertices, " << mesh->triangle_count()
+            << " triangles in " << elapsed.count() << "s" << std::endl;
+  std::cout << "  BVH: " << mesh->bvh().stats() << std::endl;
+
+  luaL_getmetatable(L, "gr.node");
+  lua_setmetatable(L, -2);
+
+  return 1;
+}
+
 // Make a point light
 extern "C"
 int gr_light_cmd(lua_State* L)
@@ -358,9 +432,37 @@ int gr_render_cmd(lua_State* L)
     lua_pop(L, 1);
   }
 
+  // Optional table of render options, e.g. { antialias = true, progressive = true }
+  RenderOptions options;
+  if (!lua_isnoneornil(L, 11)) {
+    luaL_checktype(L, 11, LUA_TTABLE);
+    get_field(L, 11, "antialias", options.antialias);
+    get_field(L, 11, "aa_threshold", options.aa_threshold);
+    luaL_argcheck(L, options.aa_threshold >= 0.0, 11, "aa_threshold must not be negative");
+    // Every level of subdivision can take up to four times as many samples
+    get_field(L, 11, "aa_depth", options.aa_depth);
+    luaL_argcheck(L, options.aa_depth >= 0 && options.aa_depth <= 4, 11, "aa_depth must be from 0 to 4");
+    get_field(L, 11, "progressive", options.progressive);
+    get_field(L, 11, "preview_interval", options.preview_interval);
+    get_field(L, 11, "preview", options.preview);
+    get_field(L, 11, "band_rows", options.band_rows);
+    // -1 is zlib's default level, which is 6
+    get_field(L, 11, "png_level", options.png.level);
+    if (options.png.level == -1) options.png.level = 6;
+    luaL_argcheck(L, options.png.level >= 0 && options.png.level <= 9, 11, "png_level must be from 0 to 9, or -1");
+
+    // Filters are named in the order of PngOptions::Filter
+    static const char* const filters[] = {"none", "sub", "up", "average", "paeth", "adaptive"};
+    std::string filter = filters[options.png.filter];
+    get_field(L, 11, "png_filter", filter);
+    const char* const* found = std::find(filters, filters + 6, filter);
+    luaL_argcheck(L, found != filters + 6, 11, "Unknown png_filter");
+    options.png.filter = (PngOptions::Filter)(found - filters);
+  }
+
   a4_render(root->node, filename, width, height,
             eye, view, up, fov,
-            ambient, lights);
+            ambient, lights, options);
   
   return 0;
 }
@@ -538,6 +640,7 @@ static const luaL_reg grlib_functions[] = {
   {"nh_sphere", gr_nh_sphere_cmd},
   {"nh_box", gr_nh_box_cmd},
   {"mesh", gr_mesh_cmd},
+  {"objmesh", gr_objmesh_cmd},
   {"light", gr_light_cmd},
   {"render", gr_render_cmd},
   {0, 0}
@@ -0,0 +1,139 @@
+#ifndef CS488_SIMD_HPP
+#define CS488_SIMD_HPP
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+// DVec is a register's worth of doubles: 4 with AVX, 2 with SSE2 and 1 (plain scalar code) otherwise,
+// picked at compile time from the instruction sets the compiler was told it can use.
+// Comparisons return masks with every bit of a lane set or clear, like the underlying instructions,
+// and select()/bits() work on those masks. load()/store() need addresses aligned to the register
+// size, loadu()/storeu() take any address. loadf() widens WIDTH floats at any address to doubles.
+
+#if defined(__AVX__)
+
+#include <immintrin.h>
+
+struct DVec {
+  static const int WIDTH = 4;
+
+  __m256d v;
+
+  DVec() {}
+  DVec(__m256d v) : v(v) {}
+  DVec(double s) : v(_mm256_set1_pd(s)) {}
+
+  static DVec load(const double* p) { return _mm256_load_pd(p); }
+  static DVec loadu(const double* p) { return _mm256_loadu_pd(p); }
+  static DVec loadf(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+  void store(double* p) const { _mm256_store_pd(p, v); }
+  void storeu(double* p) const { _mm256_storeu_pd(p, v); }
+};
+
+inline DVec operator +(DVec a, DVec b) { return _mm256_add_pd(a.v, b.v); }
+inline DVec operator -(DVec a, DVec b) { return _mm256_sub_pd(a.v, b.v); }
+inline DVec operator *(DVec a, DVec b) { return _mm256_mul_pd(a.v, b.v); }
+inline DVec operator /(DVec a, DVec b) { return _mm256_div_pd(a.v, b.v); }
+inline DVec operator <(DVec a, DVec b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+inline DVec operator <=(DVec a, DVec b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ); }
+inline DVec operator >(DVec a, DVec b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+inline DVec operator >=(DVec a, DVec b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ); }
+inline DVec operator &(DVec a, DVec b) { return _mm256_and_pd(a.v, b.v); }
+inline DVec operator |(DVec a, DVec b) { return _mm256_or_pd(a.v, b.v); }
+inline DVec min(DVec a, DVec b) { return _mm256_min_pd(a.v, b.v); }
+inline DVec max(DVec a, DVec b) { return _mm256_max_pd(a.v, b.v); }
+inline DVec sqrt(DVec a) { return _mm256_sqrt_pd(a.v); }
+inline DVec abs(DVec a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v); }
+inline DVec select(DVec mask, DVec a, DVec b) { return _mm256_blendv_pd(b.v, a.v, mask.v); }
+inline unsigned int bits(DVec mask) { return _mm256_movemask_pd(mask.v); }
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+struct DVec {
+  static const int WIDTH = 2;
+
+  __m128d v;
+
+  DVec() {}
+  DVec(__m128d v) : v(v) {}
+  DVec(double s) : v(_mm_set1_pd(s)) {}
+
+  static DVec load(const double* p) { return _mm_load_pd(p); }
+  static DVec loadu(const double* p) { return _mm_loadu_pd(p); }
+  static DVec loadf(const float* p) { return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))); }
+  void store(double* p) const { _mm_store_pd(p, v); }
+  void storeu(double* p) const { _mm_storeu_pd(p, v); }
+};
+
+inline DVec operator +(DVec a, DVec b) { return _mm_add_pd(a.v, b.v); }
+inline DVec operator -(DVec a, DVec b) { return _mm_sub_pd(a.v, b.v); }
+inline DVec operator *(DVec a, DVec b) { return _mm_mul_pd(a.v, b.v); }
+inline DVec operator /(DVec a, DVec b) { return _mm_div_pd(a.v, b.v); }
+inline DVec operator <(DVec a, DVec b) { return _mm_cmplt_pd(a.v, b.v); }
+inline DVec operator <=(DVec a, DVec b) { return _mm_cmple_pd(a.v, b.v); }
+inline DVec operator >(DVec a, DVec b) { return _mm_cmpgt_pd(a.v, b.v); }
+inline DVec operator >=(DVec a, DVec b) { return _mm_cmpge_pd(a.v, b.v); }
+inline DVec operator &(DVec a, DVec b) { return _mm_and_pd(a.v, b.v); }
+inline DVec operator |(DVec a, DVec b) { return _mm_or_pd(a.v, b.v); }
+inline DVec min(DVec a, DVec b) { return _mm_min_pd(a.v, b.v); }
+inline DVec max(DVec a, DVec b) { return _mm_max_pd(a.v, b.v); }
+inline DVec sqrt(DVec a) { return _mm_sqrt_pd(a.v); }
+inline DVec abs(DVec a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a.v); }
+inline DVec select(DVec mask, DVec a, DVec b) { return _mm_or_pd(_mm_and_pd(mask.v, a.v), _mm_andnot_pd(mask.v, b.v)); }
+inline unsigned int bits(DVec mask) { return _mm_movemask_pd(mask.v); }
+
+#else
+
+struct DVec {
+  static const int WIDTH = 1;
+
+  double v;
+
+  DVec() {}
+  DVec(double s) : v(s) {}
+
+  static DVec load(const double* p) { return *p; }
+  static DVec loadu(const double* p) { return *p; }
+  static DVec loadf(const float* p) { return *p; }
+  void store(double* p) const { *p = v; }
+  void storeu(double* p) const { *p = v; }
+
+  // Masks are all ones or all zeros in the bits of the double, the same as the vector instructions
+  static DVec mask(bool b)
+  {
+    uint64_t u = b ? ~(uint64_t)0 : 0;
+    DVec m;
+    std::memcpy(&m.v, &u, sizeof(u));
+    return m;
+  }
+  uint64_t raw() const
+  {
+    uint64_t u;
+    std::memcpy(&u, &v, sizeof(u));
+    return u;
+  }
+};
+
+inline DVec operator +(DVec a, DVec b) { return a.v + b.v; }
+inline DVec operator -(DVec a, DVec b) { return a.v - b.v; }
+inline DVec operator *(DVec a, DVec b) { return a.v * b.v; }
+inline DVec operator /(DVec a, DVec b) { return a.v / b.v; }
+inline DVec operator <(DVec a, DVec b) { return DVec::mask(a.v < b.v); }
+inline DVec operator <=(DVec a, DVec b) { return DVec::mask(a.v <= b.v); }
+inline DVec operator >(DVec a, DVec b) { return DVec::mask(a.v > b.v); }
+inline DVec operator >=(DVec a, DVec b) { return DVec::mask(a.v >= b.v); }
+inline DVec operator &(DVec a, DVec b) { return DVec::mask(a.raw() && b.raw()); }
+inline DVec operator |(DVec a, DVec b) { return DVec::mask(a.raw() || b.raw()); }
+inline DVec min(DVec a, DVec b) { return (a.v < b.v) ? a.v : b.v; }
+inline DVec max(DVec a, DVec b) { return (a.v > b.v) ? a.v : b.v; }
+inline DVec sqrt(DVec a) { return std::sqrt(a.v); }
+inline DVec abs(DVec a) { return std::fabs(a.v); }
+inline DVec select(DVec mask, DVec a, DVec b) { return mask.raw() ? a : b; }
+inline unsigned int bits(DVec mask) { return mask.raw() ? 1 : 0; }
+
+#endif
+
+#endif
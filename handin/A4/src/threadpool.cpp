@@ -0,0 +1,202 @@
+#include "threadpool.hpp"
+#include <atomic>
+
+// The pool and index of the calling thread if it is a worker
+static thread_local const ThreadPool* t_pool = NULL;
+static thread_local int t_index = -1;
+
+ThreadPool::ThreadPool(unsigned int threads)
+  : m_queued(0)
+  , m_pending(0)
+  , m_next(0)
+  , m_stop(false)
+{
+  if(threads == 0) threads = std::thread::hardware_concurrency();
+  if(threads == 0) threads = 1;
+
+  for(unsigned int i = 0; i < threads; i++) m_workers.push_back(std::unique_ptr<Worker>(new Worker()));
+  for(unsigned int i = 0; i < threads; i++) m_threads.push_back(std::thread(&ThreadPool::run, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+  wait();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+
+  for(auto& thread : m_threads) thread.join();
+}
+
+void ThreadPool::submit(const Task& task)
+{
+  unsigned int index;
+  {
+    // Count the task as pending and queued before anyone can pick it up, so neither count can drop below
+    // what is really outstanding. A worker that wakes before the push below just looks again
+    std::lock_guard<std::mutex> lock(m_mutex);
+    index = (t_pool == this) ? t_index : m_next++ % m_workers.size();
+    m_pending++;
+    m_queued++;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_workers[index]->mutex);
+    m_workers[index]->tasks.push_back(task);
+  }
+  m_wake.notify_one();
+}
+
+void ThreadPool::wait()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [this] { return m_pending == 0; });
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t)>& task)
+{
+  // Workers can get to their share after the calling thread has done everything and returned, so what
+  // they look at is kept alive by whoever lets go of it last
+  struct Shared {
+    std::function<void(size_t)> task;
+    std::atomic<size_t> next;
+    size_t done;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+  std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+  shared->task = task;
+  shared->next = 0;
+  shared->done = 0;
+
+  auto run = [shared, n] {
+    size_t i, count = 0;
+    while((i = shared->next++) < n)
+    {
+      shared->task(i);
+      count++;
+    }
+    if(count > 0)
+    {
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->done += count;
+      if(shared->done == n) shared->finished.notify_all();
+    }
+  };
+
+  for(size_t k = 1; k < n && k <= m_workers.size(); k++) submit(run);
+  run();
+
+  std::unique_lock<std::mutex> lock(shared->mutex);
+  while(shared->done != n)
+  {
+    lock.unlock();
+    bool ran = run_one();
+    lock.lock();
+
+    // Nothing queued means the rest is running on other threads. Look again now and then in case they
+    // queue more work of their own
+    if(!ran && shared->done != n) shared->finished.wait_for(lock, std::chrono::microseconds(200));
+  }
+}
+
+int ThreadPool::worker_index()
+{
+  return t_index;
+}
+
+void ThreadPool::run(unsigned int index)
+{
+  t_pool = this;
+  t_index = index;
+
+  for(;;)
+  {
+    Task task;
+    if(pop(index, task) || steal(index, task))
+    {
+      task();
+      task_done();
+      continue;
+    }
+
+    // Nothing to do anywhere, sleep until something is submitted
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+    if(m_stop && m_queued == 0) return;
+  }
+}
+
+// Runs one queued task on the calling thread, if there are any. Workers look in their own queue first,
+// other threads go through the queues in order
+bool ThreadPool::run_one()
+{
+  unsigned int index = (t_pool == this) ? t_index : 0;
+  Task task;
+  if(!pop(index, task) && !steal(index, task)) return false;
+
+  task();
+  task_done();
+  return true;
+}
+
+void ThreadPool::task_done()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if(--m_pending == 0) m_idle.notify_all();
+}
+
+bool ThreadPool::pop(unsigned int index, Task& task)
+{
+  Worker& worker = *m_workers[index];
+  {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if(worker.tasks.empty()) return false;
+
+    // Newest first, it is the most likely to still be in this core's cache
+    task = std::move(worker.tasks.back());
+    worker.tasks.pop_back();
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_queued--;
+  return true;
+}
+
+bool ThreadPool::steal(unsigned int index, Task& task)
+{
+  for(unsigned int k = 1; k < m_workers.size(); k++)
+  {
+    Worker& victim = *m_workers[(index + k) % m_workers.size()];
+    {
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if(victim.tasks.empty()) continue;
+
+      // Oldest first, it is the furthest from what the victim is working on
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queued--;
+    return true;
+  }
+
+  return false;
+}
+
+static unsigned int s_render_threads = 0;
+
+ThreadPool& render_pool()
+{
+  static ThreadPool pool(s_render_threads);
+  return pool;
+}
+
+void set_render_threads(unsigned int threads)
+{
+  s_render_threads = threads;
+}
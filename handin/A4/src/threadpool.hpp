@@ -0,0 +1,84 @@
+#ifndef CS488_THREADPOOL_HPP
+#define CS488_THREADPOOL_HPP
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// A fixed set of worker threads with one task queue each. Workers run the tasks in their own queue
+// newest first and, once it is empty, steal the oldest tasks from the other workers' queues so no
+// thread sits idle while there is still work queued anywhere.
+class ThreadPool {
+public:
+  typedef std::function<void()> Task;
+
+  // threads == 0 creates one worker per hardware thread
+  ThreadPool(unsigned int threads);
+  ~ThreadPool();
+
+  unsigned int size() const
+  {
+    return m_workers.size();
+  }
+
+  // Tasks submitted from one of this pool's workers go on that worker's own queue, tasks from
+  // other threads are spread over the queues round robin
+  void submit(const Task& task);
+
+  // Block until every submitted task has finished
+  void wait();
+
+  // Calls task(0) to task(n - 1) spread over the workers and returns once they have all finished. The
+  // calling thread takes tasks as well, so this finishes promptly even when every worker is busy with
+  // something else, and can be called from a worker. While it waits for tasks other threads picked up it
+  // runs whatever else is queued, so nested calls keep every thread busy instead of blocking the callers
+  void parallel_for(size_t n, const std::function<void(size_t)>& task);
+
+  // Like wait() but gives up after timeout. Returns true if every task has finished
+  template<typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period>& timeout)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_idle.wait_for(lock, timeout, [this] { return m_pending == 0; });
+  }
+
+  // Index of the calling thread in the pool it belongs to, -1 if it isn't a worker thread
+  static int worker_index();
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Worker> > m_workers;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake; // Signalled when tasks are queued or the pool is shutting down
+  std::condition_variable m_idle; // Signalled when the last pending task finishes
+  size_t m_queued; // Tasks sitting in a queue
+  size_t m_pending; // Tasks submitted that haven't finished yet
+  unsigned int m_next; // Queue the next task from outside the pool goes on
+  bool m_stop;
+
+  void run(unsigned int index);
+  bool run_one();
+  void task_done();
+  bool pop(unsigned int index, Task& task);
+  bool steal(unsigned int index, Task& task);
+};
+
+// The pool shared by the whole renderer, created on first use
+ThreadPool& render_pool();
+
+// Sets the number of threads render_pool() is created with, 0 for one per hardware thread.
+// Has no effect once the pool exists
+void set_render_threads(unsigned int threads);
+
+#endif